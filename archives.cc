@@ -0,0 +1,484 @@
+/*
+   Copyright (C) 2015 Red Hat, Inc.
+   This file is part of dwlocstat.
+
+   This file is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   elfutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ar.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include <libelf.h>
+
+#include "archives.hh"
+
+namespace
+{
+  enum archive_kind
+    {
+      ak_none,
+      ak_ar,
+      ak_tar,
+      ak_cpio,
+    };
+
+  // Tell what kind of archive starts with the SIZE bytes at DATA.
+  archive_kind
+  detect (char const *data, size_t size)
+  {
+    if (size >= SARMAG && std::memcmp (data, ARMAG, SARMAG) == 0)
+      return ak_ar;
+    if (size >= 6 && (std::memcmp (data, "070701", 6) == 0
+		      || std::memcmp (data, "070702", 6) == 0))
+      return ak_cpio;
+    // Both POSIX ("ustar\0") and GNU ("ustar ") tar headers.
+    if (size >= 512 && std::memcmp (data + 257, "ustar", 5) == 0)
+      return ak_tar;
+    return ak_none;
+  }
+
+  void
+  truncated ()
+  {
+    throw std::runtime_error ("Truncated archive");
+  }
+
+  // Where tar and cpio archives are read from.
+  class byte_source
+  {
+  public:
+    virtual ~byte_source () {}
+
+    // Read up to SIZE bytes to BUF.  Returns the number of bytes
+    // read, which is less than SIZE only at the end of the data.
+    virtual size_t read (char *buf, size_t size) = 0;
+
+    virtual void
+    skip (uint64_t size)
+    {
+      char buf[4096];
+      while (size > 0)
+	{
+	  size_t n = std::min <uint64_t> (size, sizeof buf);
+	  read_exactly (buf, n);
+	  size -= n;
+	}
+    }
+
+    void
+    read_exactly (char *buf, size_t size)
+    {
+      if (read (buf, size) < size)
+	truncated ();
+    }
+  };
+
+  class fd_source
+    : public byte_source
+  {
+    int m_fd;
+
+  public:
+    explicit fd_source (int fd)
+      : m_fd (fd)
+    {}
+
+    size_t
+    read (char *buf, size_t size)
+    {
+      size_t done = 0;
+      while (done < size)
+	{
+	  ssize_t got = ::read (m_fd, buf + done, size - done);
+	  if (got < 0 && errno == EINTR)
+	    continue;
+	  if (got < 0)
+	    throw std::runtime_error (std::string ("read: ")
+				      + std::strerror (errno));
+	  if (got == 0)
+	    break;
+	  done += got;
+	}
+      return done;
+    }
+
+    void
+    skip (uint64_t size)
+    {
+      // Members that aren't of interest needn't be read at all,
+      // unless we are reading from a pipe.
+      if (lseek (m_fd, size, SEEK_CUR) < 0)
+	byte_source::skip (size);
+    }
+
+    ~fd_source ()
+    {
+      ::close (m_fd);
+    }
+  };
+
+  class memory_source
+    : public byte_source
+  {
+    std::vector <char> m_data;
+    size_t m_pos;
+
+  public:
+    explicit memory_source (std::vector <char> &data)
+      : m_pos (0)
+    {
+      m_data.swap (data);
+    }
+
+    size_t
+    read (char *buf, size_t size)
+    {
+      size = std::min (size, m_data.size () - m_pos);
+      std::memcpy (buf, m_data.data () + m_pos, size);
+      m_pos += size;
+      return size;
+    }
+
+    void
+    skip (uint64_t size)
+    {
+      if (size > m_data.size () - m_pos)
+	truncated ();
+      m_pos += size;
+    }
+  };
+
+  bool
+  is_elf (char const *data, size_t size)
+  {
+    return size >= SELFMAG && std::memcmp (data, ELFMAG, SELFMAG) == 0;
+  }
+
+  // Read a member of SIZE bytes from SRC to IMAGE if it's an ELF
+  // file, or skip it otherwise.  Returns whether it was read.
+  bool
+  read_member (byte_source &src, uint64_t size, std::vector <char> &image)
+  {
+    char magic[SELFMAG];
+    if (size < SELFMAG)
+      {
+	src.skip (size);
+	return false;
+      }
+
+    src.read_exactly (magic, SELFMAG);
+    if (! is_elf (magic, SELFMAG))
+      {
+	src.skip (size - SELFMAG);
+	return false;
+      }
+
+    image.resize (size);
+    std::copy (magic, magic + SELFMAG, image.begin ());
+    src.read_exactly (image.data () + SELFMAG, size - SELFMAG);
+    return true;
+  }
+
+  class ar_archive
+    : public archive
+  {
+    int m_fd;
+    std::vector <char> m_image;
+    Elf *m_elf;
+    Elf_Cmd m_cmd;
+
+    void
+    begin (Elf *elf)
+    {
+      if (elf == NULL || elf_kind (elf) != ELF_K_AR)
+	{
+	  elf_end (elf);
+	  if (m_fd >= 0)
+	    ::close (m_fd);
+	  throw std::runtime_error (std::string ("Couldn't open archive: ")
+				    + elf_errmsg (-1));
+	}
+      m_elf = elf;
+    }
+
+  public:
+    explicit ar_archive (int fd)
+      : m_fd (fd)
+      , m_cmd (ELF_C_READ_MMAP)
+    {
+      begin (elf_begin (m_fd, ELF_C_READ_MMAP, NULL));
+    }
+
+    explicit ar_archive (std::vector <char> &image)
+      : m_fd (-1)
+      , m_cmd (ELF_C_READ_MMAP)
+    {
+      m_image.swap (image);
+      begin (elf_memory (m_image.data (), m_image.size ()));
+    }
+
+    bool
+    next (std::string &name, std::vector <char> &image)
+    {
+      while (m_cmd != ELF_C_NULL)
+	{
+	  // This is NULL past the last member.
+	  Elf *member = elf_begin (m_fd, m_cmd, m_elf);
+	  if (member == NULL)
+	    break;
+
+	  // The symbol table and the long name table are members
+	  // too, but they don't look like ELF files.
+	  Elf_Arhdr *hdr = elf_getarhdr (member);
+	  size_t size;
+	  char *raw = elf_rawfile (member, &size);
+	  bool found = hdr != NULL && raw != NULL && is_elf (raw, size);
+	  if (found)
+	    {
+	      name = hdr->ar_name;
+	      image.assign (raw, raw + size);
+	    }
+
+	  m_cmd = elf_next (member);
+	  elf_end (member);
+	  if (found)
+	    return true;
+	}
+
+      m_cmd = ELF_C_NULL;
+      return false;
+    }
+
+    ~ar_archive ()
+    {
+      elf_end (m_elf);
+      if (m_fd >= 0)
+	::close (m_fd);
+    }
+  };
+
+  // Parse a tar header number field, which is either octal, or
+  // big-endian base-256 if the top bit of the first byte is set.
+  uint64_t
+  tar_number (char const *field, size_t size)
+  {
+    unsigned char const *bytes
+      = reinterpret_cast <unsigned char const *> (field);
+    if ((bytes[0] & 0x80) != 0)
+      {
+	uint64_t ret = bytes[0] & 0x7f;
+	for (size_t i = 1; i < size; ++i)
+	  ret = (ret << 8) | bytes[i];
+	return ret;
+      }
+
+    std::string str (field, strnlen (field, size));
+    return std::strtoull (str.c_str (), NULL, 8);
+  }
+
+  // The value of "path" record of pax extended header DATA, or an
+  // empty string if there is none.  Records look like "LEN KEY=VALUE\n",
+  // where LEN counts the whole record.
+  std::string
+  pax_path (std::string const &data)
+  {
+    for (size_t pos = 0; pos < data.size (); )
+      {
+	char *end;
+	size_t len = std::strtoul (data.c_str () + pos, &end, 10);
+	if (len == 0 || *end != ' ' || pos + len > data.size ())
+	  break;
+
+	char const *begin = end + 1;
+	std::string record (begin, data.c_str () + pos + len - 1);
+	if (record.compare (0, 5, "path=") == 0)
+	  return record.substr (5);
+	pos += len;
+      }
+    return "";
+  }
+
+  class tar_archive
+    : public archive
+  {
+    std::unique_ptr <byte_source> m_src;
+
+  public:
+    explicit tar_archive (byte_source *src)
+      : m_src (src)
+    {}
+
+    bool
+    next (std::string &name, std::vector <char> &image)
+    {
+      // Name from a GNU long name or pax header that precedes the
+      // member.
+      std::string long_name;
+
+      char hdr[512];
+      while (m_src->read (hdr, sizeof hdr) == sizeof hdr
+	     // Two blocks of zeroes mark the end.
+	     && hdr[0] != '\0')
+	{
+	  uint64_t size = tar_number (hdr + 124, 12);
+	  uint64_t padding = -size & 511;
+	  char type = hdr[156];
+
+	  if (type == 'L' || type == 'x')
+	    {
+	      std::string data (size, '\0');
+	      m_src->read_exactly (&data[0], size);
+	      m_src->skip (padding);
+	      long_name = type == 'L' ? data.c_str () : pax_path (data);
+	      continue;
+	    }
+
+	  // Regular files only.
+	  bool regular = type == '0' || type == '\0' || type == '7';
+	  bool found = regular && read_member (*m_src, size, image);
+	  if (! regular)
+	    m_src->skip (size);
+	  m_src->skip (padding);
+
+	  if (found)
+	    {
+	      name = long_name;
+	      if (name.empty ())
+		{
+		  name = std::string (hdr, strnlen (hdr, 100));
+		  if (hdr[345] != '\0')
+		    name = std::string (hdr + 345, strnlen (hdr + 345, 155))
+		      + "/" + name;
+		}
+	      return true;
+	    }
+	  long_name.clear ();
+	}
+
+      return false;
+    }
+  };
+
+  class cpio_archive
+    : public archive
+  {
+    std::unique_ptr <byte_source> m_src;
+
+    static uint64_t
+    field (char const *hdr, size_t offset)
+    {
+      std::string str (hdr + offset, 8);
+      return std::strtoull (str.c_str (), NULL, 16);
+    }
+
+  public:
+    explicit cpio_archive (byte_source *src)
+      : m_src (src)
+    {}
+
+    bool
+    next (std::string &name, std::vector <char> &image)
+    {
+      while (true)
+	{
+	  char hdr[110];
+	  m_src->read_exactly (hdr, sizeof hdr);
+	  if (detect (hdr, sizeof hdr) != ak_cpio)
+	    throw std::runtime_error ("Invalid cpio header");
+
+	  uint64_t mode = field (hdr, 14);
+	  uint64_t size = field (hdr, 54);
+	  uint64_t name_size = field (hdr, 94);
+
+	  // The name is padded so that the header and the name take a
+	  // multiple of four bytes, and so is the data.
+	  std::string member_name (name_size, '\0');
+	  m_src->read_exactly (&member_name[0], name_size);
+	  m_src->skip (-(sizeof hdr + name_size) & 3);
+	  member_name = member_name.c_str ();
+
+	  if (member_name == "TRAILER!!!")
+	    return false;
+
+	  bool regular = (mode & 0170000) == 0100000;
+	  bool found = regular && read_member (*m_src, size, image);
+	  if (! regular)
+	    m_src->skip (size);
+	  m_src->skip (-size & 3);
+
+	  if (found)
+	    {
+	      name = member_name;
+	      return true;
+	    }
+	}
+    }
+  };
+}
+
+std::unique_ptr <archive>
+archive::open (char const *fname)
+{
+  elf_version (EV_CURRENT);
+
+  int fd = ::open (fname, O_RDONLY);
+  if (fd == -1)
+    throw std::runtime_error (std::strerror (errno));
+
+  char prefix[512];
+  ssize_t got = pread (fd, prefix, sizeof prefix, 0);
+  switch (detect (prefix, std::max <ssize_t> (got, 0)))
+    {
+    case ak_ar:
+      return std::unique_ptr <archive> (new ar_archive (fd));
+    case ak_tar:
+      return std::unique_ptr <archive>
+	(new tar_archive (new fd_source (fd)));
+    case ak_cpio:
+      return std::unique_ptr <archive>
+	(new cpio_archive (new fd_source (fd)));
+    case ak_none:
+      break;
+    }
+
+  ::close (fd);
+  return std::unique_ptr <archive> ();
+}
+
+std::unique_ptr <archive>
+archive::open (std::vector <char> &image)
+{
+  elf_version (EV_CURRENT);
+
+  switch (detect (image.data (), image.size ()))
+    {
+    case ak_ar:
+      return std::unique_ptr <archive> (new ar_archive (image));
+    case ak_tar:
+      return std::unique_ptr <archive>
+	(new tar_archive (new memory_source (image)));
+    case ak_cpio:
+      return std::unique_ptr <archive>
+	(new cpio_archive (new memory_source (image)));
+    case ak_none:
+      break;
+    }
+
+  return std::unique_ptr <archive> ();
+}
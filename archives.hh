@@ -0,0 +1,46 @@
+/*
+   Copyright (C) 2015 Red Hat, Inc.
+   This file is part of dwlocstat.
+
+   This file is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   elfutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#ifndef DWLOCSTAT_ARCHIVES_HH
+#define DWLOCSTAT_ARCHIVES_HH
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// Members of an ar, tar or cpio (SVR4 "newc") archive, read one by
+// one.  Tar and cpio archives are read front to back, so they can
+// come from a pipe.  Only members that are ELF files are returned,
+// the rest are skipped.
+class archive
+{
+public:
+  virtual ~archive () {}
+
+  // Read the next ELF member to NAME and IMAGE.  Returns false when
+  // there are no more.
+  virtual bool next (std::string &name, std::vector <char> &image) = 0;
+
+  // Open FNAME as an archive.  Returns NULL if it isn't one.
+  static std::unique_ptr <archive> open (char const *fname);
+
+  // Likewise for an archive whose contents are in IMAGE.  If it is
+  // an archive, the contents are taken over, and IMAGE is left empty.
+  static std::unique_ptr <archive> open (std::vector <char> &image);
+};
+
+#endif /* DWLOCSTAT_ARCHIVES_HH */
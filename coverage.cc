@@ -0,0 +1,73 @@
+/*
+   Copyright (C) 2015 Red Hat, Inc.
+   This file is part of dwlocstat.
+
+   This file is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   elfutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#include <algorithm>
+
+#include "coverage.hh"
+
+void
+normalize_ranges (ranges_t &ranges)
+{
+  std::sort (ranges.begin (), ranges.end ());
+
+  ranges_t::iterator out = ranges.begin ();
+  for (ranges_t::iterator it = ranges.begin (); it != ranges.end (); ++it)
+    {
+      if (out != ranges.begin () && it->first <= (out - 1)->second)
+	(out - 1)->second = std::max ((out - 1)->second, it->second);
+      else
+	*out++ = *it;
+    }
+  ranges.erase (out, ranges.end ());
+}
+
+void
+append_range (ranges_t *out, Dwarf_Addr low, Dwarf_Addr high)
+{
+  if (out == NULL)
+    return;
+  if (! out->empty () && out->back ().second == low)
+    out->back ().second = high;
+  else
+    out->push_back (std::make_pair (low, high));
+}
+
+Dwarf_Addr
+intersect_ranges (range_t const *a, size_t na,
+		  range_t const *b, size_t nb,
+		  ranges_t *out)
+{
+  Dwarf_Addr ret = 0;
+  size_t i = 0, j = 0;
+  while (i < na && j < nb)
+    {
+      Dwarf_Addr low = std::max (a[i].first, b[j].first);
+      Dwarf_Addr high = std::min (a[i].second, b[j].second);
+      if (low < high)
+	{
+	  ret += high - low;
+	  append_range (out, low, high);
+	}
+
+      // Move past whichever interval ends first.
+      if (a[i].second < b[j].second)
+	++i;
+      else
+	++j;
+    }
+  return ret;
+}
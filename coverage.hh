@@ -0,0 +1,44 @@
+/*
+   Copyright (C) 2015 Red Hat, Inc.
+   This file is part of dwlocstat.
+
+   This file is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   elfutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#ifndef DWLOCSTAT_COVERAGE_HH
+#define DWLOCSTAT_COVERAGE_HH
+
+// Interval arithmetic that coverage is computed with.  Intervals are
+// half-open, [first, second).  A normalized ranges_t is sorted and
+// has no overlapping or adjacent intervals.
+
+#include <cstddef>
+#include "locstat.hh"
+
+typedef ranges_t::value_type range_t;
+
+// Sort RANGES and merge intervals that overlap or touch.
+void normalize_ranges (ranges_t &ranges);
+
+// Append LOW..HIGH to OUT, merging it with the last interval of OUT
+// if the two touch.  Does nothing if OUT is NULL.
+void append_range (ranges_t *out, Dwarf_Addr low, Dwarf_Addr high);
+
+// Compute length of intersection of A and B, both normalized.  If
+// OUT is not NULL, the intersection is also appended to it using
+// append_range.  This takes O(NA + NB) time.
+Dwarf_Addr intersect_ranges (range_t const *a, size_t na,
+			     range_t const *b, size_t nb,
+			     ranges_t *out);
+
+#endif /* DWLOCSTAT_COVERAGE_HH */
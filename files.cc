@@ -22,7 +22,10 @@
 #include <cstring>
 #include <cerrno>
 #include <stdexcept>
+#include <algorithm>
 #include <unistd.h>
+#include <elfutils/version.h>
+#include <gelf.h>
 
 #include "files.hh"
 
@@ -67,6 +70,9 @@ namespace
 
 dwfl::dwfl ()
   : m_context (open_dwfl ())
+  , m_fd (-1)
+  , m_elf (NULL)
+  , m_dwarf (NULL)
 {}
 
 namespace
@@ -127,30 +133,364 @@ namespace
   };
 }
 
+namespace
+{
+  Dwarf *
+  module_dwarf (Dwfl_Module *mod)
+  {
+    Dwarf_Addr bias;
+    throw_if_failed (dwfl_module_getelf (mod, &bias),
+		     "Couldn't open ELF.", dwfl_errmsg);
+
+    Dwarf *ret = throw_if_failed (dwfl_module_getdwarf (mod, &bias),
+				  "Couldn't obtain DWARF descriptor",
+				  dwfl_errmsg);
+    return ret;
+  }
+
+  // Whether ELF is a linked file with debug info of its own, which
+  // libdw can use as it is.  Relocatable objects need relocating,
+  // and separate or supplementary debug info files need finding,
+  // both of which are left to Dwfl.
+  bool
+  self_contained (Elf *elf)
+  {
+    GElf_Ehdr ehdr;
+    size_t shstrndx;
+    if (elf_kind (elf) != ELF_K_ELF
+	|| gelf_getehdr (elf, &ehdr) == NULL
+	|| (ehdr.e_type != ET_EXEC && ehdr.e_type != ET_DYN)
+	|| elf_getshdrstrndx (elf, &shstrndx) != 0)
+      return false;
+
+    bool has_info = false;
+    for (Elf_Scn *scn = NULL; (scn = elf_nextscn (elf, scn)) != NULL; )
+      {
+	GElf_Shdr shdr;
+	if (gelf_getshdr (scn, &shdr) == NULL)
+	  return false;
+	char const *name = elf_strptr (elf, shstrndx, shdr.sh_name);
+	if (name == NULL)
+	  return false;
+
+	if (std::strcmp (name, ".gnu_debugaltlink") == 0)
+	  return false;
+	if ((std::strcmp (name, ".debug_info") == 0
+	     || std::strcmp (name, ".zdebug_info") == 0)
+	    && shdr.sh_type != SHT_NOBITS)
+	  has_info = true;
+      }
+
+    return has_info;
+  }
+}
+
+// Files that libdw can use as they are, are opened without Dwfl.
+// That skips setting up the Dwfl module, with its symbol table and
+// debuginfo search, none of which the analysis needs, and which may
+// take longer than analyzing a small file.  The file is mapped, so
+// only pages of the sections that libdw reads are touched.  Takes
+// over ELF if it returns a Dwarf handle.
+Dwarf *
+dwfl::open_direct (Elf *elf)
+{
+  if (elf != NULL && self_contained (elf))
+    {
+      m_dwarf = dwarf_begin_elf (elf, DWARF_C_READ, NULL);
+      if (m_dwarf != NULL)
+	{
+	  m_elf = elf;
+	  return m_dwarf;
+	}
+    }
+
+  elf_end (elf);
+  return NULL;
+}
+
+// Close the file that was opened before.
+void
+dwfl::close_file ()
+{
+  if (m_dwarf != NULL)
+    dwarf_end (m_dwarf);
+  elf_end (m_elf);
+  if (m_fd != -1)
+    ::close (m_fd);
+  m_dwarf = NULL;
+  m_elf = NULL;
+  m_fd = -1;
+
+  // An empty report drops the Dwfl modules, and with them the file
+  // that was opened from memory, if any.
+  {
+    dwfl_report report (m_context);
+  }
+  std::vector <char> ().swap (m_image);
+}
+
 Dwarf *
 dwfl::open_dwarf (char const *fname)
 {
+  fd fd = open (fname, O_RDONLY);
+  close_file ();
+
+  if (Dwarf *dw = open_direct (elf_begin (fd, ELF_C_READ_MMAP, NULL)))
+    {
+      m_fd = fd.release ();
+      return dw;
+    }
+
   Dwfl_Module *mod;
   {
-    fd fd = open (fname, O_RDONLY);
-
     dwfl_report report (m_context);
     mod = report.offline (m_context, fname, fname, fd);
 
     fd.release ();
   }
 
-  Dwarf_Addr bias;
-  throw_if_failed (dwfl_module_getelf (mod, &bias),
-		   "Couldn't open ELF.", dwfl_errmsg);
+  return module_dwarf (mod);
+}
+
+Dwarf *
+dwfl::open_dwarf (char const *name, std::vector <char> &image)
+{
+  std::vector <char> mine;
+  mine.swap (image);
+  close_file ();
 
-  Dwarf *ret = throw_if_failed (dwfl_module_getdwarf (mod, &bias),
-				"Couldn't obtain DWARF descriptor",
-				dwfl_errmsg);
-  return ret;
+  if (Dwarf *dw = open_direct (elf_memory (mine.data (), mine.size ())))
+    {
+      m_image.swap (mine);
+      return dw;
+    }
+
+#if _ELFUTILS_PREREQ (0, 188)
+  Dwfl_Module *mod;
+  {
+    dwfl_report report (m_context);
+    mod = throw_if_failed
+      (dwfl_report_offline_memory (m_context, name, name,
+				   mine.data (), mine.size ()),
+       "dwfl_report_offline_memory", dwfl_errmsg);
+  }
+
+  // Swapping keeps the data where the module has it.
+  m_image.swap (mine);
+  return module_dwarf (mod);
+#else
+  throw std::runtime_error ("Opening relocatable files or files without "
+			    "debug info from memory needs elfutils 0.188 "
+			    "or newer");
+#endif
+}
+
+void
+read_all (int fd, std::vector <char> &image)
+{
+  size_t size = 0;
+  image.clear ();
+  while (true)
+    {
+      if (image.size () - size < 65536)
+	image.resize (std::max <size_t> (2 * image.size (), 1 << 20));
+      ssize_t got = read (fd, image.data () + size, image.size () - size);
+      if (got < 0 && errno == EINTR)
+	continue;
+      if (got < 0)
+	throw std::runtime_error (std::string ("read: ") + strerror (errno));
+      if (got == 0)
+	break;
+      size += got;
+    }
+
+  image.resize (size);
+}
+
+Dwarf *
+dwfl::open_dwarf (char const *name, int fd)
+{
+  std::vector <char> image;
+  read_all (fd, image);
+  return open_dwarf (name, image);
 }
 
 dwfl::~dwfl ()
 {
+  close_file ();
   dwfl_end (m_context);
 }
+
+dwarf_pool::dwarf_pool (Dwarf *dw)
+  : m_dwarf (dw)
+  , m_elf (throw_if_failed (dwarf_getelf (dw), "Couldn't obtain ELF.",
+			    dwarf_errmsg))
+{}
+
+Dwarf *
+dwarf_pool::get ()
+{
+  m_handles.push_back (NULL);
+  m_handles.back ()
+    = throw_if_failed (dwarf_begin_elf (m_elf, DWARF_C_READ, NULL),
+		       "Couldn't obtain DWARF descriptor", dwarf_errmsg);
+  // Dwfl finds the alternate debug file of dwz-compressed debug info
+  // and sets it on the original handle only.  Without it, the other
+  // handles can't follow references into that file.
+  dwarf_setalt (m_handles.back (), dwarf_getalt (m_dwarf));
+  return m_handles.back ();
+}
+
+dwarf_pool::~dwarf_pool ()
+{
+  for (std::vector <Dwarf *>::iterator it = m_handles.begin ();
+       it != m_handles.end (); ++it)
+    if (*it != NULL)
+      dwarf_end (*it);
+}
+
+namespace
+{
+  // Sections that the analysis reads.
+  bool
+  prefetch_section (char const *name)
+  {
+    static char const *const names[] =
+      {
+	"info", "abbrev", "loc", "loclists", "ranges", "rnglists",
+	"str", "str_offsets", "addr",
+      };
+
+    if (std::strncmp (name, ".debug_", 7) == 0)
+      name += 7;
+    else if (std::strncmp (name, ".zdebug_", 8) == 0)
+      name += 8;
+    else
+      return false;
+
+    for (size_t i = 0; i < sizeof names / sizeof *names; ++i)
+      if (std::strcmp (name, names[i]) == 0)
+	return true;
+    return false;
+  }
+
+  // Ask the kernel to read ahead the debug sections of the ELF file
+  // open as FD, up to BUDGET bytes of them.  Returns the number of
+  // bytes asked for.
+  uint64_t
+  read_ahead (int fd, uint64_t budget)
+  {
+    Elf *elf = elf_begin (fd, ELF_C_READ_MMAP, NULL);
+    size_t shstrndx;
+    if (elf == NULL || elf_kind (elf) != ELF_K_ELF
+	|| elf_getshdrstrndx (elf, &shstrndx) != 0)
+      {
+	elf_end (elf);
+	return 0;
+      }
+
+    uint64_t ret = 0;
+    for (Elf_Scn *scn = NULL;
+	 ret < budget && (scn = elf_nextscn (elf, scn)) != NULL; )
+      {
+	GElf_Shdr shdr;
+	char const *name;
+	if (gelf_getshdr (scn, &shdr) == NULL
+	    || shdr.sh_type == SHT_NOBITS
+	    || (name = elf_strptr (elf, shstrndx, shdr.sh_name)) == NULL
+	    || ! prefetch_section (name))
+	  continue;
+
+	uint64_t size = std::min <uint64_t> (shdr.sh_size, budget - ret);
+	posix_fadvise (fd, shdr.sh_offset, size, POSIX_FADV_WILLNEED);
+	ret += size;
+      }
+
+    elf_end (elf);
+    return ret;
+  }
+}
+
+prefetcher::prefetcher (uint64_t budget)
+  : m_budget (budget)
+  , m_fetched (0)
+  , m_consumed (0)
+  , m_outstanding (0)
+  , m_stop (false)
+  , m_thread (&prefetcher::work, this)
+{}
+
+void
+prefetcher::work ()
+{
+  elf_version (EV_CURRENT);
+
+  std::unique_lock <std::mutex> lock (m_mutex);
+  while (true)
+    {
+      m_cond.wait (lock, [this] () {
+	  return m_stop || (m_fetched < m_entries.size ()
+			    && m_outstanding < m_budget);
+	});
+      if (m_stop)
+	return;
+
+      // The entry may be opened, and popped, while we're at it.
+      size_t seq = m_consumed + m_fetched;
+      std::string fname = m_entries[m_fetched].fname;
+      uint64_t budget = m_budget - m_outstanding;
+      lock.unlock ();
+
+      uint64_t bytes = 0;
+      int fd = open (fname.c_str (), O_RDONLY);
+      if (fd != -1)
+	{
+	  bytes = read_ahead (fd, budget);
+	  ::close (fd);
+	}
+
+      lock.lock ();
+      if (seq >= m_consumed)
+	{
+	  m_entries[seq - m_consumed].bytes = bytes;
+	  m_outstanding += bytes;
+	  m_fetched++;
+	}
+    }
+}
+
+void
+prefetcher::add (std::string const &fname)
+{
+  entry e = { fname, 0 };
+  std::lock_guard <std::mutex> lock (m_mutex);
+  m_entries.push_back (e);
+  m_cond.notify_one ();
+}
+
+void
+prefetcher::next ()
+{
+  std::lock_guard <std::mutex> lock (m_mutex);
+  if (m_entries.empty ())
+    return;
+
+  if (m_fetched > 0)
+    {
+      m_outstanding -= m_entries.front ().bytes;
+      m_fetched--;
+    }
+  m_entries.pop_front ();
+  m_consumed++;
+  m_cond.notify_one ();
+}
+
+prefetcher::~prefetcher ()
+{
+  {
+    std::lock_guard <std::mutex> lock (m_mutex);
+    m_stop = true;
+  }
+  m_cond.notify_one ();
+  m_thread.join ();
+}
@@ -18,16 +18,112 @@
 #ifndef DWLOCSTAT_FILES_HH
 #define DWLOCSTAT_FILES_HH
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 #include <elfutils/libdwfl.h>
 #include <elfutils/libdw.h>
 
+// Read FD, e.g. a pipe, to the end, into IMAGE.
+void read_all (int fd, std::vector <char> &image);
+
 class dwfl
 {
   Dwfl *m_context;
+
+  // The file that was opened directly with libdw, bypassing Dwfl,
+  // if any.
+  int m_fd;
+  Elf *m_elf;
+  Dwarf *m_dwarf;
+
+  // Image of the file that was opened from memory, if any.  It has
+  // to stay around for as long as the file is open.
+  std::vector <char> m_image;
+
+  Dwarf *open_direct (Elf *elf);
+  void close_file ();
+
 public:
   dwfl ();
+
+  // Each of these closes the file that was opened before.
   Dwarf *open_dwarf (char const *fname);
+
+  // Open the ELF file whose contents are in IMAGE.  The contents are
+  // taken over, and IMAGE is left empty.  NAME is used in messages.
+  Dwarf *open_dwarf (char const *name, std::vector <char> &image);
+
+  // Read an ELF file from FD, e.g. a pipe, to the end, and open it.
+  Dwarf *open_dwarf (char const *name, int fd);
+
   ~dwfl ();
 };
 
+// Additional Dwarf handles for a file that is already open, for use
+// on other threads.  All handles are created from the Elf that backs
+// the original one, so they share its mapping, as well as section
+// data that Dwfl has decompressed or relocated.  libdw picks up the
+// section data when a handle is created, so the handles have to be
+// created on one thread, but can then be used concurrently.
+class dwarf_pool
+{
+  Dwarf *m_dwarf;
+  Elf *m_elf;
+  std::vector <Dwarf *> m_handles;
+
+public:
+  explicit dwarf_pool (Dwarf *dw);
+  Dwarf *get ();
+  ~dwarf_pool ();
+};
+
+// Reads ahead the debug sections of files that are about to be
+// opened, so that they are in the page cache by the time they are
+// needed.  Only the section headers are read on the prefetcher's
+// thread, the rest is left to the kernel by posix_fadvise.  Files
+// are read ahead in the order in which they were added, as long as
+// the sections of those that were read ahead but not opened yet fit
+// in the budget.
+class prefetcher
+{
+  struct entry
+  {
+    std::string fname;
+    uint64_t bytes;
+  };
+
+  uint64_t m_budget;
+  std::mutex m_mutex;
+  std::condition_variable m_cond;
+
+  // Files that were added and not opened yet.  The first M_FETCHED
+  // of them were read ahead.  M_CONSUMED files were opened before
+  // the first one.
+  std::deque <entry> m_entries;
+  size_t m_fetched;
+  size_t m_consumed;
+  uint64_t m_outstanding;
+  bool m_stop;
+
+  std::thread m_thread;
+
+  void work ();
+
+public:
+  // BUDGET is in bytes.
+  explicit prefetcher (uint64_t budget);
+
+  // FNAME will be opened after the files added before.
+  void add (std::string const &fname);
+
+  // The oldest file added is being opened.
+  void next ();
+
+  ~prefetcher ();
+};
+
 #endif /* DWLOCSTAT_FILES_HH */
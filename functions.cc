@@ -0,0 +1,533 @@
+/*
+   Copyright (C) 2015 Red Hat, Inc.
+   This file is part of dwlocstat.
+
+   This file is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   elfutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <map>
+#include <dwarf.h>
+#include <gelf.h>
+
+#include "functions.hh"
+
+namespace
+{
+  // Contents of section NAME of DW's ELF file, or NULL if there's no
+  // such section, or if it's compressed.
+  Elf_Data *
+  section_data (Dwarf *dw, char const *name)
+  {
+    Elf *elf = dwarf_getelf (dw);
+    size_t shstrndx;
+    if (elf == NULL || elf_getshdrstrndx (elf, &shstrndx) != 0)
+      return NULL;
+
+    for (Elf_Scn *scn = NULL; (scn = elf_nextscn (elf, scn)) != NULL; )
+      {
+	GElf_Shdr shdr;
+	char const *scn_name;
+	if (gelf_getshdr (scn, &shdr) == NULL
+	    || (scn_name = elf_strptr (elf, shstrndx, shdr.sh_name)) == NULL
+	    || std::strcmp (scn_name, name) != 0)
+	  continue;
+
+	if ((shdr.sh_flags & SHF_COMPRESSED) != 0
+	    || shdr.sh_type == SHT_NOBITS)
+	  return NULL;
+	return elf_getdata (scn, NULL);
+      }
+
+    return NULL;
+  }
+
+  bool
+  big_endian (Dwarf *dw)
+  {
+    GElf_Ehdr ehdr;
+    return gelf_getehdr (dwarf_getelf (dw), &ehdr) != NULL
+      && ehdr.e_ident[EI_DATA] == ELFDATA2MSB;
+  }
+
+  // Random access to integers and strings in section data.  Reading
+  // out of bounds yields zeroes and clears OK.
+  class reader
+  {
+    unsigned char const *m_data;
+    uint64_t m_size;
+    bool m_big_endian;
+
+  public:
+    bool ok;
+
+    reader (Elf_Data const *data, bool big_endian)
+      : m_data (static_cast <unsigned char const *> (data->d_buf))
+      , m_size (data->d_size)
+      , m_big_endian (big_endian)
+      , ok (true)
+    {}
+
+    uint64_t
+    size () const
+    {
+      return m_size;
+    }
+
+    uint64_t
+    read (uint64_t off, size_t size)
+    {
+      if (off > m_size || size > m_size - off)
+	{
+	  ok = false;
+	  return 0;
+	}
+
+      uint64_t ret = 0;
+      for (size_t i = 0; i < size; ++i)
+	ret |= (uint64_t) m_data[off + (m_big_endian ? size - 1 - i : i)]
+	  << (8 * i);
+      return ret;
+    }
+
+    // Read SIZE bytes at OFF, and move OFF past them.
+    uint64_t
+    next (uint64_t &off, size_t size)
+    {
+      uint64_t ret = read (off, size);
+      off += size;
+      return ret;
+    }
+
+    uint64_t
+    uleb (uint64_t &off)
+    {
+      uint64_t ret = 0;
+      for (unsigned shift = 0; off < m_size; shift += 7)
+	{
+	  unsigned char b = m_data[off++];
+	  if (shift < 64)
+	    ret |= (uint64_t) (b & 0x7f) << shift;
+	  if ((b & 0x80) == 0)
+	    return ret;
+	}
+
+      ok = false;
+      return 0;
+    }
+
+    // NUL-terminated string at OFF, or "" if there's none.
+    char const *
+    string (uint64_t off)
+    {
+      if (off >= m_size
+	  || std::memchr (m_data + off, '\0', m_size - off) == NULL)
+	{
+	  ok = false;
+	  return "";
+	}
+      return reinterpret_cast <char const *> (m_data + off);
+    }
+  };
+
+  // Look NAMES up in .gdb_index, and add CUs that define any of them
+  // to CUS.  Returns false if there's no index that we can use, or if
+  // some of the names are not in it.  The latter is the case for C++
+  // functions in namespaces, which the index has by qualified name.
+  bool
+  gdb_index_cus (Dwarf *dw, std::set <std::string> const &names,
+		 std::set <Dwarf_Off> &cus)
+  {
+    Elf_Data *data = section_data (dw, ".gdb_index");
+    if (data == NULL)
+      return false;
+
+    // The index is always little-endian.
+    reader r (data, false);
+    uint64_t off = 0;
+    uint32_t version = r.next (off, 4);
+    if (version < 5 || version > 9)
+      return false;
+    uint32_t cu_list = r.next (off, 4);
+    uint32_t tu_list = r.next (off, 4);
+    r.next (off, 4);
+    uint32_t symtab = r.next (off, 4);
+    // Version 9 adds a shortcut table between the symbol table and
+    // the constant pool.
+    uint32_t shortcut = version >= 9 ? r.next (off, 4) : 0;
+    uint32_t pool = r.next (off, 4);
+    uint32_t symtab_end = version >= 9 ? shortcut : pool;
+
+    if (! r.ok || cu_list > tu_list || symtab > symtab_end
+	|| symtab_end > pool)
+      return false;
+    uint32_t slots = (symtab_end - symtab) / 8;
+    if (slots == 0 || (slots & (slots - 1)) != 0)
+      return false;
+    uint64_t cu_count = (tu_list - cu_list) / 16;
+
+    for (std::set <std::string>::const_iterator it = names.begin ();
+	 it != names.end (); ++it)
+      {
+	bool found = false;
+
+	// The hash that the index uses since version 5.
+	uint32_t hash = 0;
+	for (std::string::const_iterator c = it->begin ();
+	     c != it->end (); ++c)
+	  hash = hash * 67 + std::tolower ((unsigned char) *c) - 113;
+
+	// Open addressing, with a step that depends on the hash.
+	uint32_t mask = slots - 1;
+	uint32_t step = ((hash * 17) & mask) | 1;
+	uint32_t slot = hash & mask;
+	for (uint32_t n = 0; n < slots; ++n, slot = (slot + step) & mask)
+	  {
+	    uint32_t name_off = r.read (symtab + 8 * slot, 4);
+	    uint32_t vec_off = r.read (symtab + 8 * slot + 4, 4);
+	    if (name_off == 0 && vec_off == 0)
+	      break;
+	    if (*it != r.string (pool + name_off))
+	      continue;
+
+	    // Each entry is a CU index in the low 24 bits, and the kind
+	    // of symbol in bits 28..30, 3 for functions, 0 if unknown.
+	    uint64_t vec = pool + vec_off;
+	    uint32_t count = r.next (vec, 4);
+	    for (uint32_t i = 0; i < count && r.ok; ++i)
+	      {
+		uint32_t entry = r.next (vec, 4);
+		uint32_t cu = entry & 0xffffff;
+		unsigned kind = (entry >> 28) & 7;
+		if (cu < cu_count && (kind == 0 || kind == 3))
+		  {
+		    cus.insert (r.read (cu_list + 16 * cu, 8));
+		    found = true;
+		  }
+	      }
+	    break;
+	  }
+
+	if (! found)
+	  return false;
+      }
+
+    return r.ok;
+  }
+
+  // Read a value of FORM at OFF to VALUE.  Returns false for forms
+  // that a name index doesn't use.
+  bool
+  read_form (reader &r, uint64_t &off, unsigned form,
+	     unsigned offset_size, uint64_t &value)
+  {
+    switch (form)
+      {
+      case DW_FORM_flag_present:
+	value = 1;
+	return true;
+      case DW_FORM_flag:
+      case DW_FORM_data1:
+      case DW_FORM_ref1:
+	value = r.next (off, 1);
+	return true;
+      case DW_FORM_data2:
+      case DW_FORM_ref2:
+	value = r.next (off, 2);
+	return true;
+      case DW_FORM_data4:
+      case DW_FORM_ref4:
+	value = r.next (off, 4);
+	return true;
+      case DW_FORM_data8:
+      case DW_FORM_ref8:
+      case DW_FORM_ref_sig8:
+	value = r.next (off, 8);
+	return true;
+      case DW_FORM_udata:
+      case DW_FORM_ref_udata:
+      case DW_FORM_sdata:
+	value = r.uleb (off);
+	return true;
+      case DW_FORM_sec_offset:
+      case DW_FORM_strp:
+	value = r.next (off, offset_size);
+	return true;
+      }
+    return false;
+  }
+
+  struct names_abbrev
+  {
+    unsigned tag;
+    std::vector <std::pair <unsigned, unsigned> > attrs;
+  };
+
+  // Look NAMES up in .debug_names, and add DIEs of subprograms of
+  // those names to OUT.  Returns false if there's no index that we
+  // can use.
+  bool
+  debug_names_dies (Dwarf *dw, std::set <std::string> const &names,
+		    std::vector <function_die> &out)
+  {
+    Elf_Data *data = section_data (dw, ".debug_names");
+    if (data == NULL)
+      return false;
+
+    reader r (data, big_endian (dw));
+
+    // The section may have a separate index for each CU.
+    for (uint64_t unit = 0; unit < r.size () && r.ok; )
+      {
+	uint64_t off = unit;
+	unsigned offset_size = 4;
+	uint64_t length = r.next (off, 4);
+	if (length == 0xffffffff)
+	  {
+	    offset_size = 8;
+	    length = r.next (off, 8);
+	  }
+	unit = off + length;
+
+	unsigned version = r.next (off, 2);
+	r.next (off, 2);
+	if (version != 5)
+	  return false;
+
+	uint32_t cu_count = r.next (off, 4);
+	uint32_t local_tu_count = r.next (off, 4);
+	uint32_t foreign_tu_count = r.next (off, 4);
+	uint32_t bucket_count = r.next (off, 4);
+	uint32_t name_count = r.next (off, 4);
+	uint32_t abbrev_size = r.next (off, 4);
+	uint32_t aug_size = r.next (off, 4);
+	off += (aug_size + 3) & ~3;
+
+	uint64_t cu_list = off;
+	off += offset_size * (uint64_t) (cu_count + local_tu_count);
+	off += 8 * (uint64_t) foreign_tu_count;
+	uint64_t buckets = off;
+	// Without buckets, there are no hashes either.
+	uint64_t hashes = buckets + 4 * (uint64_t) bucket_count;
+	uint64_t strs = hashes + (bucket_count > 0 ? 4 * name_count : 0);
+	uint64_t entries = strs + offset_size * (uint64_t) name_count;
+	uint64_t abbrevs = entries + offset_size * (uint64_t) name_count;
+	uint64_t pool = abbrevs + abbrev_size;
+
+	std::map <uint64_t, names_abbrev> abbrev_table;
+	for (uint64_t a = abbrevs; a < pool && r.ok; )
+	  {
+	    uint64_t code = r.uleb (a);
+	    if (code == 0)
+	      break;
+	    names_abbrev &abbrev = abbrev_table[code];
+	    abbrev.tag = r.uleb (a);
+	    while (r.ok)
+	      {
+		unsigned idx = r.uleb (a);
+		unsigned form = r.uleb (a);
+		if (idx == 0 && form == 0)
+		  break;
+		abbrev.attrs.push_back (std::make_pair (idx, form));
+	      }
+	  }
+
+	for (std::set <std::string>::const_iterator it = names.begin ();
+	     it != names.end (); ++it)
+	  {
+	    // DJB hash of the case-folded name.
+	    uint32_t hash = 5381;
+	    for (std::string::const_iterator c = it->begin ();
+		 c != it->end (); ++c)
+	      hash = hash * 33 + std::tolower ((unsigned char) *c);
+
+	    // Go through names whose hashes are in the bucket of the one
+	    // we look for, or all of them if there are no buckets.
+	    // Indices count from 1.
+
+	    uint32_t bucket = bucket_count > 0 ? hash % bucket_count : 0;
+	    uint32_t i = bucket_count > 0
+	      ? r.read (buckets + 4 * (uint64_t) bucket, 4) : 1;
+	    for (; i != 0 && i <= name_count && r.ok; ++i)
+	      {
+		if (bucket_count > 0)
+		  {
+		    uint32_t h = r.read (hashes + 4 * (uint64_t) (i - 1), 4);
+		    if (h % bucket_count != bucket)
+		      break;
+		    if (h != hash)
+		      continue;
+		  }
+
+		uint64_t str = r.read (strs + offset_size * (uint64_t) (i - 1),
+				       offset_size);
+		char const *name = dwarf_getstring (dw, str, NULL);
+		if (name == NULL || *it != name)
+		  continue;
+
+		uint64_t e = pool + r.read (entries + offset_size
+					    * (uint64_t) (i - 1),
+					    offset_size);
+		while (r.ok)
+		  {
+		    uint64_t code = r.uleb (e);
+		    if (code == 0)
+		      break;
+		    std::map <uint64_t, names_abbrev>::const_iterator ab
+		      = abbrev_table.find (code);
+		    if (ab == abbrev_table.end ())
+		      return false;
+
+		    // With a single CU, entries needn't say which one.
+		    uint64_t cu = cu_count == 1 ? 0 : cu_count;
+		    uint64_t die = 0;
+		    bool in_type_unit = false;
+		    for (size_t j = 0; j < ab->second.attrs.size (); ++j)
+		      {
+			uint64_t value;
+			if (! read_form (r, e, ab->second.attrs[j].second,
+					 offset_size, value))
+			  return false;
+			switch (ab->second.attrs[j].first)
+			  {
+			  case DW_IDX_compile_unit:
+			    cu = value;
+			    break;
+			  case DW_IDX_type_unit:
+			    in_type_unit = true;
+			    break;
+			  case DW_IDX_die_offset:
+			    die = value;
+			    break;
+			  }
+		      }
+
+		    if (ab->second.tag == DW_TAG_subprogram
+			&& ! in_type_unit && cu < cu_count && die != 0)
+		      {
+			// DIE offsets are relative to the CU.
+			Dwarf_Off cu_off = r.read (cu_list + offset_size * cu,
+						   offset_size);
+			function_die fn = { cu_off, cu_off + die };
+			out.push_back (fn);
+		      }
+		  }
+	      }
+	  }
+      }
+
+    return r.ok;
+  }
+
+  // Add subprograms named by one of NAMES in the CU whose header is at
+  // CU_OFF to OUT.  Definitions of functions are children of the CU
+  // DIE, or of namespaces, so only those are looked at, and the rest
+  // is skipped over.
+  void
+  scan_children (Dwarf_Die *parent, Dwarf_Off cu_off,
+		 std::set <std::string> const &names,
+		 std::vector <function_die> &out)
+  {
+    Dwarf_Die die;
+    if (dwarf_child (parent, &die) != 0)
+      return;
+
+    do
+      switch (dwarf_tag (&die))
+	{
+	case DW_TAG_subprogram:
+	  {
+	    char const *name = dwarf_diename (&die);
+	    if (name != NULL && names.find (name) != names.end ())
+	      {
+		function_die fn = { cu_off, dwarf_dieoffset (&die) };
+		out.push_back (fn);
+	      }
+	    break;
+	  }
+
+	case DW_TAG_namespace:
+	  scan_children (&die, cu_off, names, out);
+	  break;
+	}
+    while (dwarf_siblingof (&die, &die) == 0);
+  }
+
+  void
+  scan_cu (Dwarf *dw, Dwarf_Off cu_off, std::set <std::string> const &names,
+	   std::vector <function_die> &out)
+  {
+    Dwarf_Off next;
+    size_t hsize;
+    Dwarf_Die cudie;
+    if (dwarf_nextcu (dw, cu_off, &next, &hsize, NULL, NULL, NULL) == 0
+	&& dwarf_offdie (dw, cu_off + hsize, &cudie) != NULL)
+      scan_children (&cudie, cu_off, names, out);
+  }
+}
+
+std::vector <function_die>
+find_functions (Dwarf *dw, std::set <std::string> const &names)
+{
+  std::vector <function_die> ret;
+  std::set <Dwarf_Off> cus;
+
+  if (debug_names_dies (dw, names, ret))
+    {
+      // Don't trust the index blindly.
+      std::vector <function_die>::iterator out = ret.begin ();
+      for (std::vector <function_die>::iterator it = ret.begin ();
+	   it != ret.end (); ++it)
+	{
+	  Dwarf_Die die;
+	  if (dwarf_offdie (dw, it->die, &die) != NULL
+	      && dwarf_tag (&die) == DW_TAG_subprogram)
+	    *out++ = *it;
+	}
+      ret.erase (out, ret.end ());
+    }
+  else
+    {
+      ret.clear ();
+      if (! gdb_index_cus (dw, names, cus))
+	{
+	  cus.clear ();
+	  Dwarf_Off off = 0, next;
+	  size_t hsize;
+	  while (dwarf_nextcu (dw, off, &next, &hsize, NULL, NULL, NULL) == 0)
+	    {
+	      cus.insert (off);
+	      off = next;
+	    }
+	}
+
+      for (std::set <Dwarf_Off>::const_iterator it = cus.begin ();
+	   it != cus.end (); ++it)
+	scan_cu (dw, *it, names, ret);
+    }
+
+  std::sort (ret.begin (), ret.end (),
+	     [] (function_die const &a, function_die const &b)
+	     {
+	       return a.die < b.die;
+	     });
+  ret.erase (std::unique (ret.begin (), ret.end (),
+			  [] (function_die const &a, function_die const &b)
+			  {
+			    return a.die == b.die;
+			  }),
+	     ret.end ());
+  return ret;
+}
@@ -0,0 +1,41 @@
+/*
+   Copyright (C) 2015 Red Hat, Inc.
+   This file is part of dwlocstat.
+
+   This file is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   elfutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#ifndef DWLOCSTAT_FUNCTIONS_HH
+#define DWLOCSTAT_FUNCTIONS_HH
+
+#include <set>
+#include <string>
+#include <vector>
+#include <elfutils/libdw.h>
+
+// A subprogram DIE, and the CU whose header is at CU.
+struct function_die
+{
+  Dwarf_Off cu;
+  Dwarf_Off die;
+};
+
+// Find DIEs of subprograms named by one of NAMES, sorted by offset.
+// Names are looked up in .debug_names or .gdb_index if DW has either,
+// so that only the CUs that define the functions are read.  Without
+// an index, each CU is scanned for the functions, but only its
+// top-level DIEs and namespaces are looked at.
+std::vector <function_die>
+find_functions (Dwarf *dw, std::set <std::string> const &names);
+
+#endif /* DWLOCSTAT_FUNCTIONS_HH */
@@ -34,6 +34,7 @@
 #include <cassert>
 #include <algorithm>
 #include <elfutils/libdw.h>
+#include <dwarf.h>
 
 class cu_iterator
   : public std::iterator<std::input_iterator_tag, Dwarf_Die *>
@@ -86,6 +87,15 @@ public:
     move ();
   }
 
+  // Start at the CU whose header is at OFFSET.
+  cu_iterator (Dwarf *dw, Dwarf_Off offset)
+    : m_dw (dw)
+    , m_offset (offset)
+    , m_cudie ({})
+  {
+    move ();
+  }
+
   static cu_iterator
   end ()
   {
@@ -157,6 +167,37 @@ public:
   {
   }
 
+  // Start at the CU whose header is at OFFSET.
+  all_dies_iterator (Dwarf *dw, Dwarf_Off offset)
+    : m_cuit (dw, offset)
+    , m_stack ()
+    , m_die (**m_cuit)
+  {
+  }
+
+  // Start at the DIE at DIE_OFF in the CU whose header is at
+  // CU_OFF.  The path to it is found by descending from the CU DIE,
+  // at each level to the last child that doesn't start past DIE_OFF.
+  all_dies_iterator (Dwarf *dw, Dwarf_Off cu_off, Dwarf_Off die_off)
+    : m_cuit (dw, cu_off)
+    , m_stack ()
+    , m_die (**m_cuit)
+  {
+    while (dwarf_dieoffset (&m_die) != die_off)
+      {
+	Dwarf_Die child;
+	if (! dwarf_haschildren (&m_die) || dwarf_child (&m_die, &child))
+	  throw std::runtime_error ("no DIE at given offset");
+	m_stack.push_back (dwarf_dieoffset (&m_die));
+
+	for (Dwarf_Die next;
+	     dwarf_siblingof (&child, &next) == 0
+	       && dwarf_dieoffset (&next) <= die_off; )
+	  child = next;
+	m_die = child;
+      }
+  }
+
   static all_dies_iterator
   end ()
   {
@@ -189,6 +230,20 @@ public:
 	return *this;
       }
 
+    return skip_children ();
+  }
+
+  // Move to the next DIE that isn't a child of the current one.  For
+  // a CU DIE, that is the next CU DIE.
+  all_dies_iterator
+  skip_children ()
+  {
+    if (m_stack.empty ())
+      {
+	m_die = **++m_cuit;
+	return *this;
+      }
+
     do
       switch (dwarf_siblingof (&m_die, &m_die))
 	{
@@ -226,13 +281,40 @@ public:
   std::vector<Dwarf_Die>
   stack () const
   {
-    std::vector<Dwarf_Die> ret;
-    for (all_dies_iterator it = *this; it != end (); it = it.parent ())
-      ret.push_back (**it);
-    std::reverse (ret.begin (), ret.end ());
+    std::vector<Dwarf_Die> ret (depth () + 1);
+    for (size_t n = 0; n <= depth (); ++n)
+      ancestor (n, ret[depth () - n]);
     return ret;
   }
 
+  // Depth of the current DIE in the tree, 0 for a CU DIE.
+  size_t
+  depth () const
+  {
+    return m_stack.size ();
+  }
+
+  // Fill in RET with the DIE N levels above the current one, or the
+  // current DIE itself if N is 0.  N may be at most depth ().
+  // Unlike going through parent (), this doesn't copy the iterator.
+  void
+  ancestor (size_t n, Dwarf_Die &ret) const
+  {
+    assert (n <= m_stack.size ());
+    if (n == 0)
+      ret = m_die;
+    else if (dwarf_offdie (m_cuit.m_dw, m_stack[m_stack.size () - n],
+			   &ret) == nullptr)
+      throw std::runtime_error ("ancestor:dwarf_offdie");
+  }
+
+  // Offset of parent DIE, or -1 if this is a CU DIE.
+  Dwarf_Off
+  parent_offset () const
+  {
+    return m_stack.empty () ? (Dwarf_Off)-1 : m_stack.back ();
+  }
+
   all_dies_iterator
   parent () const
   {
@@ -0,0 +1,1986 @@
+/*
+   Copyright (C) 2010, 2011, 2012, 2015 Red Hat, Inc.
+   This file is part of dwlocstat.
+
+   This file is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   elfutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#include <cstring>
+#include <cassert>
+#include <map>
+#include <random>
+#include <thread>
+#include <unordered_map>
+
+#include <dwarf.h>
+
+#include "locstat.hh"
+#include "coverage.hh"
+#include "functions.hh"
+#include "progress.hh"
+#include "dwarfstrings.h"
+#include "queue.hh"
+
+enum die_action
+  {
+    da_ok = 0,
+    da_fail,
+    da_skip,
+  };
+
+class mutability_t;
+class loclist_index;
+
+// Which parts of the location analysis are needed.  These are fixed
+// for the whole analysis, so they are template arguments of the
+// analysis kernel below, and the branches that a particular
+// combination doesn't need are compiled away.
+template <bool Mutability, bool Implicit, bool FullImplicit>
+struct location_policy
+{
+  // Whether DIE's mutability should be determined.
+  static bool const interested_mutability = Mutability;
+
+  // Whether dt_implicit_pointer should be determined.
+  static bool const interested_implicit = Implicit;
+
+  // Look at the location of DIEs that implicit pointers refer to,
+  // instead of considering the addresses covered.
+  static bool const full_implicit = FullImplicit;
+};
+
+template <class P>
+static die_action process_location (Dwarf_Attribute *locattr,
+				    ranges_t const &ranges,
+				    std::bitset <count_die_types> &die_type,
+				    mutability_t &mut,
+				    int &coverage,
+				    ranges_t *covered_ranges,
+				    loclist_index &lists,
+				    locstat_error &err);
+
+template <class P>
+static die_action process_implicit_pointer (Dwarf_Attribute *locattr,
+					    Dwarf_Op *op,
+					    ranges_t const &ranges,
+					    std::bitset <count_die_types> &die_type,
+					    mutability_t &mut,
+					    int &coverage,
+					    ranges_t *covered_ranges,
+					    loclist_index &lists,
+					    locstat_error &err);
+
+class mutability_t
+{
+  bool _m_is_mutable;
+  bool _m_is_immutable;
+
+public:
+  mutability_t ()
+    : _m_is_mutable (false)
+    , _m_is_immutable (false)
+  {
+  }
+
+  void set (bool what)
+  {
+    if (what)
+      _m_is_mutable = true;
+    else
+      _m_is_immutable = true;
+  }
+
+  void set_both ()
+  {
+    set (true);
+    set (false);
+  }
+
+  template <class P>
+  die_action
+  locexpr (Dwarf_Attribute *attr, ranges_t const &ranges,
+	   Dwarf_Op *expr, size_t len,
+	   loclist_index &lists, locstat_error &err)
+  {
+    // We scan the expression looking for DW_OP_{bit_,}piece operators
+    // which mark ends of sub-expressions to us.  Some operators
+    // describe the object value instead its location: these are
+    // immutable.
+    bool m = true;
+    for (size_t i = 0; i < len; ++i)
+      switch (expr[i].atom)
+	{
+	case DW_OP_implicit_value:
+	case DW_OP_stack_value:
+	  m = false;
+	  break;
+
+	case DW_OP_bit_piece:
+	case DW_OP_piece:
+	  set (m);
+	  m = true;
+	  break;
+
+	case DW_OP_GNU_entry_value:
+	  // This evaluates its argument as location expression, with
+	  // registers having values as they had on entry to current
+	  // function.  It says nothing about how the value is used,
+	  // so it's just a complex way of computing some constant.
+	  // Thus it can be either mutable or immutable.
+	  break;
+
+	case DW_OP_GNU_implicit_pointer:
+	  if (! P::full_implicit)
+	    {
+	      set_both ();
+	      return da_ok;
+	    }
+
+	  // Mutability of implicit pointer depends on mutability of
+	  // referenced expression.  We don't want referenced DIE's
+	  // type to surface at this DIE, and we can therefore leave
+	  // out interested_implicit.
+	  std::bitset <count_die_types> ref_die_type;
+	  int coverage = 0;
+	  if (die_action a = (process_implicit_pointer
+			      <location_policy <true, false, true> >
+			      (attr, expr + i, ranges,
+			       ref_die_type, *this, coverage, NULL,
+			       lists, err)))
+	    return a;
+
+	  // The location was valid.  This ought to be the only
+	  // operand.
+	  return da_ok;
+	};
+
+    set (m);
+    return da_ok;
+  }
+
+  bool is_mutable () const { return _m_is_mutable; }
+  bool is_immutable () const { return _m_is_immutable; }
+};
+
+void
+die_ranges (Dwarf_Die *die, ranges_t &ret)
+{
+  Dwarf_Addr base;
+  Dwarf_Addr start, end;
+  ret.clear ();
+  for (ptrdiff_t it = 0;
+       (it = dwarf_ranges (die, it, &base, &start, &end)) != 0; )
+    ret.push_back (std::make_pair (start, end));
+}
+
+ranges_t
+die_ranges (Dwarf_Die *die)
+{
+  ranges_t ret;
+  die_ranges (die, ret);
+  return ret;
+}
+
+namespace
+{
+  bool
+  same_string (char const *a, char const *b)
+  {
+    return a == b || (a != NULL && b != NULL && strcmp (a, b) == 0);
+  }
+}
+
+bool
+locstat_error::operator== (locstat_error const &other) const
+{
+  return attr == other.attr
+    && same_string (what, other.what)
+    && same_string (detail, other.detail);
+}
+
+std::ostream &
+operator<< (std::ostream &os, locstat_error const &err)
+{
+  os << err.what;
+  if (err.attr != 0)
+    os << '(' << dwarf_attr_string (err.attr) << ')';
+  if (err.detail != NULL)
+    os << ": " << err.detail;
+  return os;
+}
+
+namespace
+{
+  // Keep at most this many example DIEs per kind of error.
+  size_t const max_examples = 3;
+}
+
+void
+locstat_result::add_error (locstat_error const &err, Dwarf_Off die_off)
+{
+  errors++;
+  std::vector <locstat_error_kind>::iterator it = error_kinds.begin ();
+  while (it != error_kinds.end () && ! (it->error == err))
+    ++it;
+  if (it == error_kinds.end ())
+    {
+      locstat_error_kind kind = { err, 0, std::vector <Dwarf_Off> () };
+      it = error_kinds.insert (error_kinds.end (), kind);
+    }
+
+  it->count++;
+  if (it->examples.size () < max_examples)
+    it->examples.push_back (die_off);
+}
+
+void
+locstat_result::merge (locstat_result const &other)
+{
+  for (int i = cov_00; i <= 100; ++i)
+    if (unsigned long count = other.tally.at (i))
+      tally.add (i, count);
+
+  for (std::vector <locstat_error_kind>::const_iterator kt
+	 = other.error_kinds.begin (); kt != other.error_kinds.end (); ++kt)
+    {
+      errors += kt->count;
+      std::vector <locstat_error_kind>::iterator it = error_kinds.begin ();
+      while (it != error_kinds.end () && ! (it->error == kt->error))
+	++it;
+      if (it == error_kinds.end ())
+	{
+	  error_kinds.push_back (*kt);
+	  continue;
+	}
+
+      it->count += kt->count;
+      for (std::vector <Dwarf_Off>::const_iterator et = kt->examples.begin ();
+	   et != kt->examples.end ()
+	     && it->examples.size () < max_examples; ++et)
+	it->examples.push_back (*et);
+    }
+
+  cus += other.cus;
+  bytes += other.bytes;
+  expired = expired || other.expired;
+  cus_total = std::max (cus_total, other.cus_total);
+  bytes_total = std::max (bytes_total, other.bytes_total);
+}
+
+namespace
+{
+  // Decoded ranges of DIEs of one CU, keyed by DIE offset, so that
+  // each range list is decoded only once, even though e.g. the CU
+  // DIE is the scope of every global variable.  The cached ranges
+  // are sorted and coalesced, and if WINDOW is not empty, clipped to
+  // it.  The cache is emptied when a DIE from another CU is looked
+  // up, which keeps it small.
+  class range_cache
+  {
+    Dwarf_CU *m_cu;
+    std::unordered_map <Dwarf_Off, ranges_t> m_ranges;
+    ranges_t const &m_window;
+    ranges_t m_unclipped;
+
+  public:
+    explicit range_cache (ranges_t const &window)
+      : m_cu (NULL)
+      , m_window (window)
+    {}
+
+    ranges_t const &
+    get (Dwarf_Die *die)
+    {
+      if (die->cu != m_cu)
+	{
+	  m_ranges.clear ();
+	  m_cu = die->cu;
+	}
+
+      std::pair <std::unordered_map <Dwarf_Off, ranges_t>::iterator, bool>
+	ins = m_ranges.insert (std::make_pair (dwarf_dieoffset (die),
+					       ranges_t ()));
+      ranges_t &ret = ins.first->second;
+      if (ins.second)
+	{
+	  die_ranges (die, ret);
+	  normalize_ranges (ret);
+	  if (! m_window.empty ())
+	    {
+	      m_unclipped.swap (ret);
+	      ret.clear ();
+	      intersect_ranges (m_unclipped.data (), m_unclipped.size (),
+				m_window.data (), m_window.size (), &ret);
+	    }
+	}
+
+      return ret;
+    }
+  };
+}
+
+// Look through parental dies and point RET at the non-empty ranges
+// instance closest to IT hierarchically.
+static die_action
+find_ranges (elfutils::all_dies_iterator const &it, range_cache &cache,
+	     ranges_t const *&ret, locstat_error &err)
+{
+  for (size_t n = 0; n <= it.depth (); ++n)
+    {
+      Dwarf_Die die;
+      it.ancestor (n, die);
+      ret = &cache.get (&die);
+      if (! ret->empty ())
+	return da_ok;
+    }
+
+  err = locstat_error ("no ranges at this or parental DIEs");
+  return da_fail;
+}
+
+enum loclist_entry_kind
+  {
+    lk_empty,
+    lk_implicit_pointer,
+    lk_other,
+  };
+
+// Location lists of one CU, decoded into a structure of arrays.
+// Entries of all lists are stored one after another, each list
+// occupying a slice of the arrays, so that the whole CU's lists are
+// kept in a handful of vectors that keep their storage across CUs.
+// Lists are looked up by the attribute that refers to them.
+class loclist_index
+{
+public:
+  struct list
+  {
+    // Slice of the entry arrays.
+    size_t first;
+    size_t count;
+
+    // Slice of NONEMPTY with the union of non-empty entries.
+    size_t nonempty_first;
+    size_t nonempty_count;
+
+    // Largest number of entries that cover a single address.
+    size_t depth;
+
+    // Whether any of the entries is a lone implicit pointer.
+    bool implicit_pointer;
+  };
+
+  std::vector <Dwarf_Addr> begin;
+  std::vector <Dwarf_Addr> end;
+  std::vector <Dwarf_Op *> expr;
+  std::vector <size_t> len;
+  std::vector <unsigned char> kind;
+  ranges_t nonempty;
+
+private:
+  Dwarf_CU *m_cu;
+
+  // Lists by the attribute value that refers to them.  FIRST is -1
+  // for lists that couldn't be decoded.
+  std::unordered_map <unsigned char const *, list> m_lists;
+
+  // Scratch space for computing list depth, (address, +1/-1).
+  std::vector <std::pair <Dwarf_Addr, int> > m_events;
+
+  void
+  truncate (size_t size)
+  {
+    begin.resize (size);
+    end.resize (size);
+    expr.resize (size);
+    len.resize (size);
+    kind.resize (size);
+  }
+
+  bool
+  decode (Dwarf_Attribute *attr, list &l)
+  {
+    l.first = begin.size ();
+    l.implicit_pointer = false;
+
+    Dwarf_Addr base, lo, hi;
+    Dwarf_Op *ops;
+    size_t nops;
+    ptrdiff_t off = 0;
+    while ((off = dwarf_getlocations (attr, off, &base, &lo, &hi,
+				      &ops, &nops)) > 0)
+      {
+	begin.push_back (lo);
+	end.push_back (hi);
+	expr.push_back (ops);
+	len.push_back (nops);
+	if (nops == 0)
+	  kind.push_back (lk_empty);
+	else if (nops == 1 && ops->atom == DW_OP_GNU_implicit_pointer)
+	  {
+	    kind.push_back (lk_implicit_pointer);
+	    l.implicit_pointer = true;
+	  }
+	else
+	  kind.push_back (lk_other);
+      }
+
+    if (off != 0)
+      {
+	truncate (l.first);
+	return false;
+      }
+    l.count = begin.size () - l.first;
+
+    m_events.clear ();
+    l.nonempty_first = nonempty.size ();
+    for (size_t i = l.first; i < l.first + l.count; ++i)
+      if (begin[i] < end[i])
+	{
+	  m_events.push_back (std::make_pair (begin[i], 1));
+	  m_events.push_back (std::make_pair (end[i], -1));
+	  if (kind[i] != lk_empty)
+	    nonempty.push_back (std::make_pair (begin[i], end[i]));
+	}
+
+    // Ends sort before begins at the same address, as intervals are
+    // half-open.
+    std::sort (m_events.begin (), m_events.end ());
+    l.depth = 0;
+    size_t depth = 0;
+    for (size_t i = 0; i < m_events.size (); ++i)
+      if (m_events[i].second > 0)
+	l.depth = std::max (l.depth, ++depth);
+      else
+	--depth;
+
+    // Normalize the union in place at the end of NONEMPTY.
+    ranges_t tail (nonempty.begin () + l.nonempty_first, nonempty.end ());
+    normalize_ranges (tail);
+    nonempty.resize (l.nonempty_first);
+    nonempty.insert (nonempty.end (), tail.begin (), tail.end ());
+    l.nonempty_count = tail.size ();
+
+    return true;
+  }
+
+public:
+  loclist_index ()
+    : m_cu (NULL)
+  {}
+
+  // Drop decoded lists unless DIE is from the CU they belong to.
+  // This is not done by get, because indices handed out before have
+  // to stay valid while a list is being processed.
+  void
+  enter (Dwarf_Die *die)
+  {
+    if (die->cu != m_cu)
+      {
+	m_cu = die->cu;
+	m_lists.clear ();
+	truncate (0);
+	nonempty.clear ();
+      }
+  }
+
+  // Find the list that ATTR refers to, decoding it if necessary, and
+  // store it to RET.  Returns false if the list can't be decoded.
+  // RET is returned by value, as decoding further lists may move
+  // things around.
+  bool
+  get (Dwarf_Attribute *attr, list &ret)
+  {
+    std::pair <std::unordered_map <unsigned char const *,
+				   list>::iterator, bool> ins
+      = m_lists.insert (std::make_pair (attr->valp, list ()));
+    if (ins.second && ! decode (attr, ins.first->second))
+      ins.first->second.first = (size_t)-1;
+    ret = ins.first->second;
+    return ret.first != (size_t)-1;
+  }
+};
+
+// Compute coverage of RANGES by location list L of LOCATTR.  Rather
+// than asking libdw about each address, this splits the ranges into
+// runs of addresses covered by the same entries and looks at each run
+// once.  Only runs that are covered by nothing but implicit pointers
+// are then walked address by address.  The result is the same as that
+// of the address-by-address loop in process_location.
+template <class P>
+static die_action
+process_loclist (Dwarf_Attribute *locattr,
+		 loclist_index::list const &l,
+		 ranges_t const &ranges,
+		 std::bitset <count_die_types> &die_type,
+		 mutability_t &mut,
+		 int &coverage,
+		 ranges_t *covered_ranges,
+		 loclist_index &lists,
+		 locstat_error &err)
+{
+  size_t length = 0;
+  size_t covered = 0;
+  size_t const first = l.first;
+  size_t const count = l.count;
+
+  // Same limit on expressions per address as with
+  // dwarf_getlocation_addr in process_location.
+  size_t const nlocs = 10;
+  size_t idx[nlocs];
+
+  // When the limit can't kick in, and there are no implicit pointers
+  // to resolve, coverage is simply the size of the intersection of
+  // RANGES with the union of non-empty entries.
+  if (l.depth <= nlocs && (! P::full_implicit || ! l.implicit_pointer))
+    {
+      for (size_t i = first; i < first + count; ++i)
+	{
+	  bool sole_implicit = lists.kind[i] == lk_implicit_pointer;
+	  if (lists.kind[i] == lk_empty
+	      || ! (P::interested_mutability
+		    || (P::interested_implicit && sole_implicit)))
+	    continue;
+
+	  range_t entry (lists.begin[i], lists.end[i]);
+	  if (entry.first >= entry.second
+	      || intersect_ranges (&entry, 1, ranges.data (), ranges.size (),
+				   NULL) == 0)
+	    continue;
+
+	  if (P::interested_mutability)
+	    if (die_action a = mut.locexpr <P> (locattr, ranges,
+						lists.expr[i], lists.len[i],
+						lists, err))
+	      return a;
+	  if (sole_implicit && P::interested_implicit)
+	    die_type.set (dt_implicit_pointer);
+	}
+
+      for (ranges_t::const_iterator rit = ranges.begin ();
+	   rit != ranges.end (); ++rit)
+	length += rit->second - rit->first;
+
+      // Only take the address of NONEMPTY now, mut.locexpr above
+      // may have added to it.
+      covered = intersect_ranges (ranges.data (), ranges.size (),
+				  lists.nonempty.data () + l.nonempty_first,
+				  l.nonempty_count, covered_ranges);
+
+      if (length == 0 || covered == 0)
+	coverage = cov_00;
+      else
+	coverage = 100 * covered / length;
+      return da_ok;
+    }
+
+  // Single-address scope for looking at implicit pointers.
+  ranges_t this_range;
+
+  for (ranges_t::const_iterator rit = ranges.begin ();
+       rit != ranges.end (); ++rit)
+    {
+      Dwarf_Addr low = rit->first;
+      Dwarf_Addr high = rit->second;
+      length += high - low;
+
+      for (Dwarf_Addr addr = low, next; addr < high; addr = next)
+	{
+	  // Find the entries that cover ADDR, and where the run of
+	  // addresses covered by the same entries ends.  Note that
+	  // resolving implicit pointers below may add to LISTS, so
+	  // the entries are always accessed by index.
+	  size_t got = 0;
+	  next = high;
+	  for (size_t i = first; i < first + count; ++i)
+	    if (lists.begin[i] <= addr && addr < lists.end[i])
+	      {
+		if (got < nlocs)
+		  idx[got++] = i;
+		next = std::min (next, lists.end[i]);
+	      }
+	    else if (lists.begin[i] > addr)
+	      next = std::min (next, lists.begin[i]);
+
+	  bool cover = false;
+	  bool implicit = false;
+	  for (size_t j = 0; j < got; ++j)
+	    {
+	      size_t i = idx[j];
+	      if (lists.kind[i] == lk_empty)
+		continue;
+
+	      if (P::interested_mutability)
+		if (die_action a = mut.locexpr <P> (locattr, ranges,
+						    lists.expr[i],
+						    lists.len[i],
+						    lists, err))
+		  return a;
+
+	      bool sole_implicit = lists.kind[i] == lk_implicit_pointer;
+	      if (! sole_implicit || ! P::full_implicit)
+		cover = true;
+	      if (sole_implicit)
+		{
+		  implicit = true;
+		  if (P::interested_implicit)
+		    die_type.set (dt_implicit_pointer);
+		}
+	    }
+
+	  if (cover)
+	    {
+	      covered += next - addr;
+	      append_range (covered_ranges, addr, next);
+	      continue;
+	    }
+
+	  // The run is uncovered at this point, but singleton
+	  // DW_OP_GNU_implicit_pointer's may cover some of its
+	  // addresses.
+	  if (implicit && P::full_implicit)
+	    for (Dwarf_Addr a = addr; a < next; ++a)
+	      for (size_t j = 0; j < got; ++j)
+		if (lists.kind[idx[j]] == lk_implicit_pointer)
+		  {
+		    this_range.assign (1, std::make_pair (a, a + 1));
+		    int this_coverage;
+		    if (die_action r = (process_implicit_pointer <P>
+					(locattr, lists.expr[idx[j]],
+					 this_range,
+					 die_type, mut, this_coverage,
+					 NULL, lists, err)))
+		      {
+			coverage = cov_00;
+			return r;
+		      }
+		    if (this_coverage == 100)
+		      {
+			covered++;
+			append_range (covered_ranges, a, a + 1);
+			break;
+		      }
+		  }
+	}
+    }
+
+  if (length == 0 || covered == 0)
+    coverage = cov_00;
+  else
+    coverage = 100 * covered / length;
+  return da_ok;
+}
+
+template <class P>
+static die_action
+process_implicit_pointer (Dwarf_Attribute *locattr,
+			  Dwarf_Op *op,
+			  ranges_t const &ranges,
+			  std::bitset <count_die_types> &die_type,
+			  mutability_t &mut,
+			  int &coverage,
+			  ranges_t *covered_ranges,
+			  loclist_index &lists,
+			  locstat_error &err)
+{
+  // For implicit pointer, we are actually interested in how location
+  // expressions on target DIE cover this DIE's addresses.
+  Dwarf_Attribute ref_attr;
+  if (dwarf_getlocation_implicit_pointer (locattr, op, &ref_attr) < 0)
+    {
+      // No location expression at referenced DIE.  That means
+      // this location expression is itself empty.
+      coverage = cov_00;
+      return da_ok;
+    }
+
+  return process_location <location_policy <P::interested_mutability,
+					    P::interested_implicit, true> >
+    (&ref_attr, ranges, die_type, mut, coverage, covered_ranges, lists, err);
+}
+
+template <class P>
+static die_action
+process_location (Dwarf_Attribute *locattr,
+		  ranges_t const &ranges,
+		  std::bitset <count_die_types> &die_type,
+		  mutability_t &mut,
+		  int &coverage,
+		  ranges_t *covered_ranges,
+		  loclist_index &lists,
+		  locstat_error &err)
+{
+  Dwarf_Op *expr;
+  size_t len;
+  loclist_index::list l;
+
+  // no location
+  if (locattr == NULL)
+    {
+      coverage = cov_00;
+      if (P::interested_mutability)
+	mut.set_both ();
+    }
+
+  // consts need no location
+  else if (dwarf_whatattr (locattr) == DW_AT_const_value)
+    {
+      coverage = 100;
+      if (P::interested_mutability)
+	mut.set (false);
+      if (covered_ranges != NULL)
+	covered_ranges->insert (covered_ranges->end (),
+				ranges.begin (), ranges.end ());
+    }
+
+  // non-list location
+  else if (dwarf_getlocation (locattr, &expr, &len) == 0)
+    {
+      if (len == 1 && expr[0].atom == DW_OP_addr)
+	// Globals and statics have non-list location that is a
+	// singleton DW_OP_addr expression.
+	die_type.set (dt_single_addr);
+
+      else if (P::full_implicit
+	       && len == 1 && expr[0].atom == DW_OP_GNU_implicit_pointer)
+	return process_implicit_pointer <P> (locattr, expr, ranges,
+					     die_type, mut, coverage,
+					     covered_ranges, lists, err);
+
+      if (P::interested_mutability)
+	if (die_action a = mut.locexpr <P> (locattr, ranges, expr, len,
+					    lists, err))
+	  return a;
+      coverage = (len == 0) ? cov_00 : 100;
+      if (covered_ranges != NULL && len != 0)
+	covered_ranges->insert (covered_ranges->end (),
+				ranges.begin (), ranges.end ());
+    }
+
+  // location list
+  else if (lists.get (locattr, l))
+    return process_loclist <P> (locattr, l, ranges, die_type, mut,
+				coverage, covered_ranges, lists, err);
+
+  // location list that couldn't be decoded as a whole.  Go address
+  // by address, so that we fail exactly where libdw does.
+  else
+    {
+      size_t length = 0;
+      size_t covered = 0;
+
+      // Arbitrarily assume that there will be no more than 10
+      // expressions per address.
+      size_t nlocs = 10;
+      Dwarf_Op *exprs[nlocs];
+      size_t exprlens[nlocs];
+
+      // Single-address scope for looking at implicit pointers.
+      // Allocated only once per location list, when first needed.
+      ranges_t this_range;
+
+      for (ranges_t::const_iterator rit = ranges.begin ();
+	   rit != ranges.end (); ++rit)
+	{
+	  Dwarf_Addr low = rit->first;
+	  Dwarf_Addr high = rit->second;
+	  length += high - low;
+	  //std::cerr << " " << low << ".." << high << std::endl;
+
+	  for (Dwarf_Addr addr = low; addr < high; ++addr)
+	    {
+	      int got = dwarf_getlocation_addr (locattr, addr,
+						exprs, exprlens, nlocs);
+	      if (got < 0)
+		{
+		  err = locstat_error ("dwarf_getlocation_addr", 0,
+				       dwarf_errmsg (-1));
+		  return da_fail;
+		}
+
+	      // At least one expression for the address must
+	      // be of non-zero length for us to count that
+	      // address as covered.
+	      bool cover = false;
+	      for (int i = 0; i < got; ++i)
+		{
+		  if (exprlens[i] == 0)
+		    continue;
+
+		  if (P::interested_mutability)
+		    if (die_action a = mut.locexpr <P> (locattr, ranges,
+							exprs[i], exprlens[i],
+							lists, err))
+		      return a;
+
+		  bool sole_implicit = exprlens[i] == 1
+		    && exprs[i]->atom == DW_OP_GNU_implicit_pointer;
+		  if (! sole_implicit || ! P::full_implicit)
+		    // Either it's not implicit pointer, or it is, but
+		    // we don't care.
+		    cover = true;
+		  if (sole_implicit && P::interested_implicit)
+		    die_type.set (dt_implicit_pointer);
+		}
+
+	      // If the address is uncovered at this point, look again
+	      // for singleton DW_OP_GNU_implicit_pointer's.  We need
+	      // to figure out whether at least one of them covers
+	      // this address.
+	      if (! cover && P::full_implicit)
+		for (int i = 0; i < got; ++i)
+		  if (exprlens[i] == 1
+		      && exprs[i]->atom == DW_OP_GNU_implicit_pointer)
+		    {
+		      this_range.assign (1, std::make_pair (addr, addr + 1));
+		      int this_coverage;
+		      if (die_action a = (process_implicit_pointer <P>
+					  (locattr, exprs[i], this_range,
+					   die_type, mut, this_coverage,
+					   NULL, lists, err)))
+			{
+			  coverage = cov_00;
+			  return a;
+			}
+		      if (this_coverage == 100)
+			{
+			  cover = true;
+			  break;
+			}
+		    }
+
+	      if (cover)
+		{
+		  covered++;
+		  append_range (covered_ranges, addr, addr + 1);
+		}
+	    }
+	}
+
+      if (length == 0 || covered == 0)
+	coverage = cov_00;
+      else
+	coverage = 100 * covered / length;
+    }
+  return da_ok;
+}
+
+// Store value of flag ATTR_NAME at DIE to VAL.  A missing attribute
+// counts as false.
+static die_action
+die_flag_value (Dwarf_Die *die, unsigned attr_name, bool &val,
+		locstat_error &err)
+{
+  Dwarf_Attribute attr;
+  val = false;
+
+  // XXX do we need dwarf_attr_integrate here?
+  if (dwarf_attr (die, attr_name, &attr) != NULL
+      && dwarf_formflag (&attr, &val) != 0)
+    {
+      err = locstat_error ("dwarf_formflag", attr_name, dwarf_errmsg (-1));
+      return da_fail;
+    }
+
+  return da_ok;
+}
+
+static bool
+is_inlined (Dwarf_Die *die)
+{
+  // DW_AT_inline is a constant, not a flag.
+  Dwarf_Attribute attr;
+  Dwarf_Word val;
+  if (dwarf_attr (die, DW_AT_inline, &attr) == NULL
+      || dwarf_formudata (&attr, &val) != 0)
+    return false;
+  return val == DW_INL_inlined || val == DW_INL_declared_inlined;
+}
+
+namespace
+{
+  // Instantiation of process_location for one location_policy.
+  typedef die_action (*location_kernel)
+    (Dwarf_Attribute *locattr, ranges_t const &ranges,
+     std::bitset <count_die_types> &die_type, mutability_t &mut,
+     int &coverage, ranges_t *covered_ranges, loclist_index &lists,
+     locstat_error &err);
+
+  template <bool Mutability, bool Implicit>
+  location_kernel
+  select_kernel (bool full_implicit)
+  {
+    if (full_implicit)
+      return process_location <location_policy <Mutability, Implicit,
+						 true> >;
+    else
+      return process_location <location_policy <Mutability, Implicit,
+						 false> >;
+  }
+
+  location_kernel
+  select_kernel (bool interested_mutability, bool interested_implicit,
+		 bool full_implicit)
+  {
+    if (interested_mutability)
+      return interested_implicit
+	? select_kernel <true, true> (full_implicit)
+	: select_kernel <true, false> (full_implicit);
+    else
+      return interested_implicit
+	? select_kernel <false, true> (full_implicit)
+	: select_kernel <false, false> (full_implicit);
+  }
+
+  // Settings that the analysis of each DIE depends on.
+  struct policy
+  {
+    die_type_matcher const &ignore;
+    std::bitset <count_die_types> interested;
+    bool interested_mutability;
+    bool want_covered;
+    std::chrono::steady_clock::time_point deadline;
+    std::set <Dwarf_Off> const &skip_cus;
+    unsigned shard;
+    unsigned shards;
+    std::set <std::string> const &functions;
+    ranges_t pc_ranges;
+
+    // process_location specialized for the above.
+    location_kernel locate;
+
+    explicit policy (locstat_options const &opts)
+      : ignore (opts.ignore)
+      , interested (opts.ignore | opts.classify)
+      , interested_mutability (interested.test (dt_mutable)
+			       || interested.test (dt_immutable))
+      , want_covered (opts.want_covered)
+      , deadline (opts.deadline)
+      , skip_cus (opts.skip_cus)
+      , shard (opts.shard)
+      , shards (opts.shards)
+      , functions (opts.functions)
+      , pc_ranges (opts.pc_ranges)
+      , locate (select_kernel (interested_mutability,
+			       interested.test (dt_implicit_pointer),
+			       ! opts.ignore_implicit_pointer))
+    {
+      normalize_ranges (pc_ranges);
+    }
+  };
+
+  // Decide whether the DIE at IT should be analyzed (da_ok) or not
+  // (da_skip), and determine those of its classes that depend on its
+  // position in the tree.  LOC_NAME is set to the name of attribute
+  // that holds the location, or 0 if there's none.
+  die_action
+  select_die (policy const &pol, elfutils::all_dies_iterator &it,
+	      std::bitset <count_die_types> &die_type, unsigned &loc_name,
+	      locstat_error &err)
+  {
+    die_type_matcher const &ignore = pol.ignore;
+    std::bitset <count_die_types> const &interested = pol.interested;
+    Dwarf_Die *die = *it;
+
+    // We are interested in variables and formal parameters
+    bool is_formal_parameter = dwarf_tag (die) == DW_TAG_formal_parameter;
+    if (! is_formal_parameter && dwarf_tag (die) != DW_TAG_variable)
+      return da_skip;
+
+    // Ignore those that are just declarations
+    bool flag;
+    if (die_flag_value (die, DW_AT_declaration, flag, err) != da_ok)
+      return da_fail;
+    if (flag)
+      return da_skip;
+
+    // Possibly ignore artificial, unless configured othewise.
+    if (ignore.test (dt_artificial))
+      {
+	if (die_flag_value (die, DW_AT_artificial, flag, err) != da_ok)
+	  return da_fail;
+	if (flag)
+	  return da_skip;
+      }
+
+    // Of formal parameters we ignore those that are children of
+    // subprograms that are themselves declarations.
+    if (is_formal_parameter && it.depth () > 0)
+      {
+	Dwarf_Die parent;
+	it.ancestor (1, parent);
+	if (dwarf_tag (&parent) == DW_TAG_subroutine_type)
+	  return da_skip;
+	if (die_flag_value (&parent, DW_AT_declaration, flag, err) != da_ok)
+	  return da_fail;
+	if (flag)
+	  return da_skip;
+      }
+
+    if (interested.test (dt_inlined)
+	|| interested.test (dt_inlined_subroutine))
+      {
+	bool inlined = false;
+	bool inlined_subroutine = false;
+	for (size_t n = 0; n <= it.depth (); ++n)
+	  {
+	    Dwarf_Die die2;
+	    it.ancestor (n, die2);
+	    if (interested.test (dt_inlined)
+		&& dwarf_tag (&die2) == DW_TAG_subprogram
+		&& is_inlined (&die2))
+	      {
+		inlined = true;
+		if (interested.test (dt_inlined_subroutine)
+		    && inlined_subroutine)
+		  break;
+	      }
+	    if (interested.test (dt_inlined_subroutine)
+		&& dwarf_tag (&die2) == DW_TAG_inlined_subroutine)
+	      {
+		inlined_subroutine = true;
+		if (interested.test (dt_inlined)
+		    && inlined)
+		  break;
+	      }
+	  }
+
+	if (inlined)
+	  {
+	    if (ignore.test (dt_inlined))
+	      return da_skip;
+	    die_type.set (dt_inlined);
+	  }
+	if (inlined_subroutine)
+	  {
+	    if (ignore.test (dt_inlined_subroutine))
+	      return da_skip;
+	    die_type.set (dt_inlined_subroutine, inlined_subroutine);
+	  }
+      }
+
+    Dwarf_Attribute locattr_mem,
+      *locattr = dwarf_attr_integrate (die, DW_AT_location, &locattr_mem);
+    loc_name = locattr != NULL ? DW_AT_location : 0;
+
+    // Also ignore extern globals -- these have DW_AT_external and
+    // no DW_AT_location.
+    if (die_flag_value (die, DW_AT_external, flag, err) != da_ok)
+      return da_fail;
+    if (flag && locattr == NULL)
+      return da_skip;
+
+    if (locattr == NULL
+	&& dwarf_attr (die, DW_AT_const_value, &locattr_mem) != NULL)
+      loc_name = DW_AT_const_value;
+
+    return da_ok;
+  }
+
+  // Look up the location attribute that select_die chose.
+  Dwarf_Attribute *
+  location_attr (Dwarf_Die *die, unsigned loc_name, Dwarf_Attribute *mem)
+  {
+    switch (loc_name)
+      {
+      case DW_AT_location:
+	return dwarf_attr_integrate (die, DW_AT_location, mem);
+      case DW_AT_const_value:
+	return dwarf_attr (die, DW_AT_const_value, mem);
+      }
+    return NULL;
+  }
+
+  // Compute coverage of SCOPE by location of DIE, and finish DIE's
+  // classification.  Returns da_skip if the DIE turns out to be
+  // ignored.
+  die_action
+  measure_die (policy const &pol, Dwarf_Die *die, unsigned loc_name,
+	       ranges_t const &scope, std::bitset <count_die_types> &die_type,
+	       int &coverage, ranges_t *covered, loclist_index &lists,
+	       locstat_error &err)
+  {
+    die_type_matcher const &ignore = pol.ignore;
+    Dwarf_Attribute locattr_mem,
+      *locattr = location_attr (die, loc_name, &locattr_mem);
+
+    mutability_t mut;
+    lists.enter (die);
+    if (die_action a = pol.locate (locattr, scope, die_type, mut,
+				   coverage, covered, lists, err))
+      return a;
+
+    if ((ignore & die_type).any ())
+      return da_skip;
+
+    if (coverage == cov_00)
+      {
+	if (ignore.test (dt_no_coverage))
+	  return da_skip;
+	die_type.set (dt_no_coverage);
+      }
+    else if (pol.interested_mutability)
+      {
+	assert (mut.is_mutable () || mut.is_immutable ());
+	if (mut.is_mutable ())
+	  {
+	    if (ignore.test (dt_mutable))
+	      return da_skip;
+	    die_type.set (dt_mutable);
+	  }
+	if (mut.is_immutable ())
+	  {
+	    if (ignore.test (dt_immutable))
+	      return da_skip;
+	    die_type.set (dt_immutable);
+	  }
+      }
+
+    return da_ok;
+  }
+
+  bool
+  has_ranges (Dwarf_Die *die)
+  {
+    return dwarf_hasattr (die, DW_AT_ranges)
+      || (dwarf_hasattr (die, DW_AT_low_pc)
+	  && dwarf_hasattr (die, DW_AT_high_pc));
+  }
+
+  // A CU as the span of .debug_info that it occupies.  If ROOTS is
+  // not empty, only the subtrees of the DIEs at those offsets, in
+  // ascending order, are analyzed.
+  struct cu_span
+  {
+    Dwarf_Off begin;
+    Dwarf_Off end;
+    std::vector <Dwarf_Off> roots;
+  };
+
+  // Walk through the DIEs of CU that are to be analyzed.  If WINDOW
+  // is not empty, subtrees of DIEs whose ranges are all outside of
+  // it are skipped.
+  class cu_walk
+  {
+    Dwarf *m_dw;
+    cu_span const &m_cu;
+    ranges_t const &m_window;
+    std::vector <Dwarf_Off>::const_iterator m_root;
+    elfutils::all_dies_iterator m_it;
+    size_t m_depth;
+    bool m_valid;
+    ranges_t m_ranges;
+
+    // Whether M_IT is still in the CU, and in the subtree of the
+    // current root, if any.
+    bool
+    inside () const
+    {
+      return m_it != elfutils::all_dies_iterator::end ()
+	&& m_it.cu ().offset () == m_cu.end
+	&& (m_cu.roots.empty () || m_it.depth () > m_depth);
+    }
+
+    // Whether the DIE at M_IT has ranges, none of which are in the
+    // window.  DIEs whose ranges are empty are not skipped, their
+    // variables fall back to the scope of the parent.
+    bool
+    outside_window ()
+    {
+      if (m_window.empty () || ! has_ranges (*m_it))
+	return false;
+
+      m_ranges.clear ();
+      die_ranges (*m_it, m_ranges);
+      normalize_ranges (m_ranges);
+      return ! m_ranges.empty ()
+	&& intersect_ranges (m_ranges.data (), m_ranges.size (),
+			     m_window.data (), m_window.size (),
+			     NULL) == 0;
+    }
+
+    // Move past the DIE at M_IT, and past its children as well if
+    // SKIP, to the next DIE that is to be analyzed.
+    void
+    advance (bool skip)
+    {
+      while (true)
+	{
+	  if (skip)
+	    m_it.skip_children ();
+	  else
+	    ++m_it;
+
+	  if (inside ())
+	    {
+	      skip = outside_window ();
+	      if (! skip)
+		return;
+	      continue;
+	    }
+
+	  if (m_cu.roots.empty ())
+	    {
+	      m_valid = false;
+	      return;
+	    }
+
+	  // Roots that come before where the walk ended up were in
+	  // the subtree that was just walked.
+	  Dwarf_Off pos = m_it != elfutils::all_dies_iterator::end ()
+	    && m_it.cu ().offset () == m_cu.end
+	    ? dwarf_dieoffset (*m_it) : (Dwarf_Off) -1;
+	  while (++m_root != m_cu.roots.end () && *m_root < pos)
+	    ;
+	  if (m_root == m_cu.roots.end ())
+	    {
+	      m_valid = false;
+	      return;
+	    }
+
+	  m_it = elfutils::all_dies_iterator (m_dw, m_cu.begin, *m_root);
+	  m_depth = m_it.depth ();
+	  skip = outside_window ();
+	  if (! skip)
+	    return;
+	}
+    }
+
+  public:
+    cu_walk (Dwarf *dw, cu_span const &cu, ranges_t const &window)
+      : m_dw (dw)
+      , m_cu (cu)
+      , m_window (window)
+      , m_root (cu.roots.begin ())
+      , m_it (cu.roots.empty ()
+	      ? elfutils::all_dies_iterator (dw, cu.begin)
+	      : elfutils::all_dies_iterator (dw, cu.begin, *m_root))
+      , m_depth (m_it.depth ())
+      , m_valid (true)
+    {
+      // The CU was picked because .debug_aranges says that it
+      // overlaps the window, but the CU DIE may still disagree, e.g.
+      // if the table includes padding.  There's nothing to walk then.
+      if (outside_window ())
+	{
+	  if (cu.roots.empty ())
+	    m_valid = false;
+	  else
+	    advance (true);
+	}
+    }
+
+    bool
+    valid () const
+    {
+      return m_valid;
+    }
+
+    elfutils::all_dies_iterator &
+    it ()
+    {
+      return m_it;
+    }
+
+    void
+    next ()
+    {
+      advance (false);
+    }
+  };
+
+  // Assign each of CUS to one of SHARDS shards, so that the shards
+  // get about the same number of bytes.  Biggest CUs are assigned
+  // first, each to the shard that has the fewest bytes so far.  This
+  // only depends on CUS, so every shard comes up with the same
+  // assignment on its own.
+  std::vector <unsigned>
+  assign_shards (std::vector <cu_span> const &cus, unsigned shards)
+  {
+    std::vector <size_t> order (cus.size ());
+    for (size_t i = 0; i < order.size (); ++i)
+      order[i] = i;
+    std::stable_sort (order.begin (), order.end (),
+		      [&cus] (size_t a, size_t b)
+		      {
+			return cus[a].end - cus[a].begin
+			  > cus[b].end - cus[b].begin;
+		      });
+
+    std::vector <uint64_t> load (shards, 0);
+    std::vector <unsigned> ret (cus.size ());
+    for (size_t i = 0; i < order.size (); ++i)
+      {
+	unsigned lightest = std::min_element (load.begin (), load.end ())
+	  - load.begin ();
+	ret[order[i]] = lightest;
+	load[lightest] += cus[order[i]].end - cus[order[i]].begin;
+      }
+    return ret;
+  }
+
+  // Offsets of headers of CUs whose code overlaps WINDOW.  CUs are
+  // looked up in the address ranges table of DW.  Those that the
+  // table doesn't mention, e.g. because the file has no
+  // .debug_aranges, are checked by the ranges of their CU DIE.
+  std::set <Dwarf_Off>
+  cus_in_window (Dwarf *dw, ranges_t const &window)
+  {
+    // Offsets of CU DIEs that the table mentions, and of those that
+    // it says overlap WINDOW.
+    std::set <Dwarf_Off> listed;
+    std::set <Dwarf_Off> overlap;
+
+    Dwarf_Aranges *aranges;
+    size_t count;
+    if (dwarf_getaranges (dw, &aranges, &count) == 0)
+      for (size_t i = 0; i < count; ++i)
+	{
+	  Dwarf_Addr addr;
+	  Dwarf_Word length;
+	  Dwarf_Off die_off;
+	  if (dwarf_getarangeinfo (dwarf_onearange (aranges, i),
+				   &addr, &length, &die_off) != 0)
+	    continue;
+
+	  listed.insert (die_off);
+	  range_t range (addr, addr + length);
+	  if (length > 0
+	      && intersect_ranges (&range, 1, window.data (), window.size (),
+				   NULL) > 0)
+	    overlap.insert (die_off);
+	}
+
+    std::set <Dwarf_Off> ret;
+    Dwarf_Off off = 0;
+    Dwarf_Off next;
+    size_t hsize;
+    ranges_t ranges;
+    for (; dwarf_nextcu (dw, off, &next, &hsize, NULL, NULL, NULL) == 0;
+	 off = next)
+      {
+	Dwarf_Off die_off = off + hsize;
+	if (listed.find (die_off) != listed.end ())
+	  {
+	    if (overlap.find (die_off) != overlap.end ())
+	      ret.insert (off);
+	    continue;
+	  }
+
+	Dwarf_Die cudie;
+	if (dwarf_offdie (dw, die_off, &cudie) == NULL)
+	  continue;
+	ranges.clear ();
+	die_ranges (&cudie, ranges);
+	normalize_ranges (ranges);
+	if (intersect_ranges (ranges.data (), ranges.size (),
+			      window.data (), window.size (), NULL) > 0)
+	  ret.insert (off);
+      }
+
+    return ret;
+  }
+
+  // List CUs of DW in the order in which they should be analyzed,
+  // and note their totals in RESULT.  With a deadline, the CUs are
+  // shuffled, so that whatever part gets done is a fair sample of
+  // the file rather than its beginning.  The shuffle is seeded with a
+  // constant, so that runs are reproducible.  Only CUs of the
+  // selected shard are listed.  Skipped CUs are left out after the
+  // shuffle, so that the order of the others doesn't depend on
+  // them.
+  std::vector <cu_span>
+  schedule_cus (Dwarf *dw, policy const &pol, locstat_result &result)
+  {
+    std::vector <cu_span> ret;
+    Dwarf_Off off = 0;
+    Dwarf_Off next;
+    size_t hsize;
+    if (! pol.functions.empty ())
+      {
+	// Only the CUs that define the functions are of interest.
+	std::vector <function_die> fns = find_functions (dw, pol.functions);
+	for (std::vector <function_die>::const_iterator it = fns.begin ();
+	     it != fns.end (); ++it)
+	  {
+	    if (ret.empty () || ret.back ().begin != it->cu)
+	      {
+		if (dwarf_nextcu (dw, it->cu, &next, &hsize,
+				  NULL, NULL, NULL) != 0)
+		  continue;
+		cu_span cu = { it->cu, next };
+		ret.push_back (cu);
+	      }
+	    ret.back ().roots.push_back (it->die);
+	  }
+      }
+    else
+      while (dwarf_nextcu (dw, off, &next, &hsize, NULL, NULL, NULL) == 0)
+	{
+	  cu_span cu = { off, next };
+	  ret.push_back (cu);
+	  off = next;
+	}
+
+    if (! pol.pc_ranges.empty ())
+      {
+	// Only the CUs with code in the window are of interest.
+	std::set <Dwarf_Off> in_window = cus_in_window (dw, pol.pc_ranges);
+	std::vector <cu_span>::iterator out = ret.begin ();
+	for (std::vector <cu_span>::iterator it = ret.begin ();
+	     it != ret.end (); ++it)
+	  if (in_window.find (it->begin) != in_window.end ())
+	    *out++ = *it;
+	ret.erase (out, ret.end ());
+      }
+
+    result.cus_total = ret.size ();
+    result.bytes_total = 0;
+    for (std::vector <cu_span>::const_iterator it = ret.begin ();
+	 it != ret.end (); ++it)
+      result.bytes_total += it->end - it->begin;
+
+    if (pol.shards > 1)
+      {
+	std::vector <unsigned> shard = assign_shards (ret, pol.shards);
+	std::vector <cu_span>::iterator out = ret.begin ();
+	for (size_t i = 0; i < ret.size (); ++i)
+	  if (shard[i] == pol.shard)
+	    *out++ = ret[i];
+	ret.erase (out, ret.end ());
+      }
+
+    if (pol.deadline != std::chrono::steady_clock::time_point::max ())
+      std::shuffle (ret.begin (), ret.end (), std::mt19937 (1));
+
+    if (! pol.skip_cus.empty ())
+      {
+	std::vector <cu_span>::iterator out = ret.begin ();
+	for (std::vector <cu_span>::iterator it = ret.begin ();
+	     it != ret.end (); ++it)
+	  if (pol.skip_cus.find (it->begin) == pol.skip_cus.end ())
+	    *out++ = *it;
+	ret.erase (out, ret.end ());
+      }
+
+    return ret;
+  }
+
+  // Whether to start analyzing another CU.
+  bool
+  before_deadline (policy const &pol)
+  {
+    return pol.deadline == std::chrono::steady_clock::time_point::max ()
+      || std::chrono::steady_clock::now () < pol.deadline;
+  }
+
+  // Note in RESULT that all DIEs of CU were tallied, and tell
+  // VISITOR.
+  void
+  finish_cu (cu_span const &cu, locstat_result &result,
+	     locstat_visitor *visitor)
+  {
+    result.cus++;
+    result.bytes += cu.end - cu.begin;
+    if (visitor != NULL)
+      visitor->cu_done (cu.begin, result);
+  }
+
+  locstat_result
+  analyze_serial (Dwarf *dw, policy const &pol, progress_meter &progress,
+		  locstat_visitor *visitor)
+  {
+    locstat_result result;
+    progress_meter::local local_progress (progress);
+
+    range_cache ranges (pol.pc_ranges);
+    loclist_index lists;
+
+    // Kept across DIEs, so that its storage is reused.
+    ranges_t covered;
+
+    std::vector <cu_span> cus = schedule_cus (dw, pol, result);
+    std::vector <cu_span>::const_iterator cu = cus.begin ();
+    for (; cu != cus.end () && before_deadline (pol); ++cu)
+      {
+	if (visitor != NULL && ! visitor->want_cu (cu->begin))
+	  continue;
+
+	local_progress.start (cu->begin);
+	for (cu_walk walk (dw, *cu, pol.pc_ranges); walk.valid ();
+	     walk.next ())
+	  {
+	    elfutils::all_dies_iterator &it = walk.it ();
+	    std::bitset <count_die_types> die_type;
+	    Dwarf_Die *die = *it;
+	    local_progress.die (dwarf_dieoffset (die));
+
+	    unsigned loc_name;
+	    int coverage;
+	    ranges_t const *scope = NULL;
+	    locstat_error err;
+	    die_action a = select_die (pol, it, die_type, loc_name, err);
+	    if (a == da_ok)
+	      a = find_ranges (it, ranges, scope, err);
+	    if (a == da_ok)
+	      {
+		covered.clear ();
+		a = measure_die (pol, die, loc_name, *scope, die_type,
+				 coverage, pol.want_covered ? &covered : NULL,
+				 lists, err);
+	      }
+
+	    if (a == da_fail)
+	      {
+		result.add_error (err, dwarf_dieoffset (die));
+		if (visitor != NULL)
+		  visitor->error (die, err);
+	      }
+	    if (a != da_ok)
+	      continue;
+
+	    result.tally.add (coverage);
+	    if (visitor != NULL)
+	      {
+		die_info info = { it, die, die_type, coverage,
+				  *scope, covered };
+		visitor->die (info);
+	      }
+	  }
+
+	local_progress.done (cu->end);
+	finish_cu (*cu, result, visitor);
+      }
+
+    result.expired = cu != cus.end ();
+    return result;
+  }
+
+  // A DIE on its way through the pipeline.  The traversal stage
+  // fills in the first part, a coverage worker the rest.  ACTION is
+  // da_ok for DIEs that the worker should process, or da_fail if
+  // the traversal already failed; the worker then updates it.
+  struct work_item
+  {
+    Dwarf_Off die_off;
+    unsigned loc_name;
+    std::bitset <count_die_types> die_type;
+    die_action action;
+    locstat_error error;
+
+    // Candidates for the scope, nearest first.  The first one whose
+    // ranges are not empty is taken, like find_ranges does.
+    std::vector <Dwarf_Off> scope_offs;
+
+    int coverage;
+    ranges_t scope;
+    ranges_t covered;
+  };
+
+  // Items travel through the queues in batches, so that the
+  // synchronization cost is paid once per many DIEs.  Batches are
+  // recycled, and only the first SIZE items are valid, so that the
+  // storage of the items is reused as well.
+  struct work_batch
+  {
+    static size_t const capacity = 256;
+
+    uint64_t seq;
+    size_t size;
+    std::vector <work_item> items;
+
+    // Iterators at the items, so that the visitor can look around
+    // the tree.  Only touched by the traversal thread.
+    std::vector <elfutils::all_dies_iterator> iters;
+
+    // CUs that end in this batch, each with the number of items
+    // that come before its end.
+    std::vector <std::pair <size_t, cu_span> > cu_ends;
+  };
+
+  void
+  coverage_worker (Dwarf *dw, policy const &pol,
+		   bounded_queue <work_batch *> &in,
+		   bounded_queue <work_batch *> &out)
+  {
+    range_cache ranges (pol.pc_ranges);
+    loclist_index lists;
+    for (work_batch *batch; (batch = in.pop ()) != NULL; out.push (batch))
+      for (std::vector <work_item>::iterator it = batch->items.begin ();
+	   it != batch->items.begin () + batch->size; ++it)
+	{
+	  if (it->action != da_ok)
+	    continue;
+
+	  it->scope.clear ();
+	  it->covered.clear ();
+
+	  Dwarf_Die die;
+	  if (dwarf_offdie (dw, it->die_off, &die) == NULL)
+	    {
+	      it->error = locstat_error ("dwarf_offdie", 0, dwarf_errmsg (-1));
+	      it->action = da_fail;
+	      continue;
+	    }
+
+	  for (std::vector <Dwarf_Off>::const_iterator jt
+		 = it->scope_offs.begin ();
+	       jt != it->scope_offs.end () && it->scope.empty (); ++jt)
+	    {
+	      Dwarf_Die scope_die;
+	      if (dwarf_offdie (dw, *jt, &scope_die) != NULL)
+		it->scope = ranges.get (&scope_die);
+	    }
+	  if (it->scope.empty ())
+	    {
+	      it->error = locstat_error ("no ranges at this or parental DIEs");
+	      it->action = da_fail;
+	      continue;
+	    }
+
+	  it->action = measure_die (pol, &die, it->loc_name, it->scope,
+				    it->die_type, it->coverage,
+				    pol.want_covered ? &it->covered : NULL,
+				    lists, it->error);
+	}
+  }
+
+  size_t
+  pow2_at_least (size_t n)
+  {
+    size_t ret = 2;
+    while (ret < n)
+      ret *= 2;
+    return ret;
+  }
+
+  // Pipelined analysis.  The calling thread traverses the DIE tree
+  // and does the cheap filtering, then hands the DIEs in batches to
+  // coverage workers, each of which uses its own Dwarf handle.
+  // Processed batches come back to the calling thread, which tallies
+  // them in their original order, so the visitor sees the same
+  // sequence of DIEs as with serial analysis.
+  class pipeline
+  {
+    policy const &m_pol;
+    locstat_visitor *m_visitor;
+    locstat_result &m_result;
+
+    // Both queues are large enough for all batches in flight, so
+    // that pushing never blocks.
+    size_t m_max_batches;
+    bounded_queue <work_batch *> m_work;
+    bounded_queue <work_batch *> m_done;
+    std::vector <std::thread> m_workers;
+
+    std::vector <work_batch *> m_all;
+    std::vector <work_batch *> m_free;
+    std::map <uint64_t, work_batch *> m_pending;
+    work_batch *m_cur;
+    uint64_t m_next_seq;
+    uint64_t m_next_tally;
+
+    void
+    tally (work_batch *batch)
+    {
+      std::vector <std::pair <size_t, cu_span> >::const_iterator
+	end = batch->cu_ends.begin ();
+      for (size_t i = 0; i < batch->size; ++i)
+	{
+	  for (; end != batch->cu_ends.end () && end->first == i; ++end)
+	    finish_cu (end->second, m_result, m_visitor);
+
+	  work_item const &item = batch->items[i];
+	  if (item.action == da_fail)
+	    {
+	      m_result.add_error (item.error, item.die_off);
+	      if (m_visitor != NULL)
+		m_visitor->error (*batch->iters[i], item.error);
+	    }
+	  else if (item.action == da_ok)
+	    {
+	      m_result.tally.add (item.coverage);
+	      if (m_visitor != NULL)
+		{
+		  die_info info = { batch->iters[i], *batch->iters[i],
+				    item.die_type, item.coverage,
+				    item.scope, item.covered };
+		  m_visitor->die (info);
+		}
+	    }
+	}
+
+      for (; end != batch->cu_ends.end (); ++end)
+	finish_cu (end->second, m_result, m_visitor);
+
+      batch->size = 0;
+      batch->cu_ends.clear ();
+      m_free.push_back (batch);
+    }
+
+    // Collect finished batches and tally those that are next in
+    // order.  If WAIT, block until at least one batch is finished;
+    // the caller makes sure that one is on its way.
+    void
+    drain (bool wait)
+    {
+      if (wait)
+	{
+	  work_batch *batch = m_done.pop ();
+	  m_pending[batch->seq] = batch;
+	}
+      for (work_batch *batch; m_done.try_pop (batch); )
+	m_pending[batch->seq] = batch;
+
+      for (std::map <uint64_t, work_batch *>::iterator it;
+	   (it = m_pending.begin ()) != m_pending.end ()
+	     && it->first == m_next_tally; ++m_next_tally)
+	{
+	  work_batch *batch = it->second;
+	  m_pending.erase (it);
+	  tally (batch);
+	}
+    }
+
+    work_batch *
+    get_batch ()
+    {
+      // All batches are in flight then, so some will come back.
+      while (m_free.empty () && m_all.size () >= m_max_batches)
+	drain (true);
+
+      if (! m_free.empty ())
+	{
+	  work_batch *ret = m_free.back ();
+	  m_free.pop_back ();
+	  return ret;
+	}
+
+      m_all.push_back (new work_batch);
+      m_all.back ()->size = 0;
+      m_all.back ()->items.reserve (work_batch::capacity);
+      m_all.back ()->iters.reserve (work_batch::capacity);
+      return m_all.back ();
+    }
+
+    void
+    submit ()
+    {
+      m_cur->seq = m_next_seq++;
+      m_work.push (m_cur);
+      m_cur = NULL;
+      drain (false);
+    }
+
+    void
+    stop ()
+    {
+      for (size_t i = 0; i < m_workers.size (); ++i)
+	m_work.push (NULL);
+      for (size_t i = 0; i < m_workers.size (); ++i)
+	m_workers[i].join ();
+      m_workers.clear ();
+    }
+
+  public:
+    pipeline (policy const &pol, std::vector <Dwarf *> const &dwarfs,
+	      locstat_visitor *visitor, locstat_result &result)
+      : m_pol (pol)
+      , m_visitor (visitor)
+      , m_result (result)
+      , m_max_batches (4 * dwarfs.size () + 2)
+      , m_work (pow2_at_least (m_max_batches + dwarfs.size ()))
+      , m_done (pow2_at_least (m_max_batches))
+      , m_cur (NULL)
+      , m_next_seq (0)
+      , m_next_tally (0)
+    {
+      for (std::vector <Dwarf *>::const_iterator it = dwarfs.begin ();
+	   it != dwarfs.end (); ++it)
+	m_workers.push_back (std::thread (coverage_worker, *it,
+					  std::cref (m_pol),
+					  std::ref (m_work),
+					  std::ref (m_done)));
+    }
+
+    ~pipeline ()
+    {
+      stop ();
+      for (std::vector <work_batch *>::iterator it = m_all.begin ();
+	   it != m_all.end (); ++it)
+	delete *it;
+    }
+
+    void
+    add (elfutils::all_dies_iterator const &it, Dwarf_Die *die,
+	 die_action action, locstat_error const &err,
+	 std::vector <Dwarf_Off> const &scope_offs, unsigned loc_name,
+	 std::bitset <count_die_types> const &die_type)
+    {
+      if (m_cur == NULL)
+	m_cur = get_batch ();
+
+      size_t i = m_cur->size++;
+      if (i == m_cur->items.size ())
+	{
+	  m_cur->items.push_back (work_item ());
+	  m_cur->iters.push_back (it);
+	}
+      else
+	m_cur->iters[i] = it;
+
+      work_item &item = m_cur->items[i];
+      item.die_off = dwarf_dieoffset (die);
+      item.scope_offs = scope_offs;
+      item.loc_name = loc_name;
+      item.die_type = die_type;
+      item.action = action;
+      item.error = err;
+
+      if (m_cur->size == work_batch::capacity)
+	submit ();
+    }
+
+    // Note that all DIEs of CU were added.
+    void
+    end_cu (cu_span const &cu)
+    {
+      if (m_cur == NULL)
+	m_cur = get_batch ();
+      m_cur->cu_ends.push_back (std::make_pair (m_cur->size, cu));
+    }
+
+    // Wait for all submitted work and tally it.
+    void
+    finish ()
+    {
+      if (m_cur != NULL)
+	submit ();
+      while (m_next_tally < m_next_seq)
+	drain (true);
+    }
+  };
+
+  // Finds the DIEs that may hold the scope of a variable: those of
+  // the variable and its ancestors that have ranges, nearest first.
+  // Workers decode the ranges, here we only look whether they are
+  // there.  Ranges that decode to nothing are skipped by the worker,
+  // so each candidate further up is passed along as well.
+  class scope_finder
+  {
+    // Candidates among ancestors of the last parent, including
+    // itself.  Siblings tend to come in a row, so this saves walking
+    // up the tree.
+    Dwarf_Off m_parent_off;
+    std::vector <Dwarf_Off> m_parent_scopes;
+
+  public:
+    scope_finder ()
+      : m_parent_off (-1)
+    {}
+
+    void
+    find (elfutils::all_dies_iterator const &it, Dwarf_Die *die,
+	  std::vector <Dwarf_Off> &ret)
+    {
+      if (it.parent_offset () != m_parent_off)
+	{
+	  m_parent_off = it.parent_offset ();
+	  m_parent_scopes.clear ();
+	  for (size_t n = 1; n <= it.depth (); ++n)
+	    {
+	      Dwarf_Die ancestor;
+	      it.ancestor (n, ancestor);
+	      if (has_ranges (&ancestor))
+		m_parent_scopes.push_back (dwarf_dieoffset (&ancestor));
+	    }
+	}
+
+      ret.clear ();
+      if (has_ranges (die))
+	ret.push_back (dwarf_dieoffset (die));
+      ret.insert (ret.end (), m_parent_scopes.begin (),
+		  m_parent_scopes.end ());
+    }
+  };
+
+  locstat_result
+  analyze_pipelined (Dwarf *dw, policy const &pol, progress_meter &progress,
+		     std::vector <Dwarf *> const &workers,
+		     locstat_visitor *visitor)
+  {
+    locstat_result result;
+    pipeline pipeline (pol, workers, visitor, result);
+    progress_meter::local local_progress (progress);
+
+    scope_finder scopes;
+    std::vector <Dwarf_Off> scope_offs;
+
+    // Only accepting new CUs is subject to the deadline, those
+    // already in the pipeline are finished.  CUs are counted as done
+    // when they are tallied.
+    std::vector <cu_span> cus = schedule_cus (dw, pol, result);
+    std::vector <cu_span>::const_iterator cu = cus.begin ();
+    for (; cu != cus.end () && before_deadline (pol); ++cu)
+      {
+	if (visitor != NULL && ! visitor->want_cu (cu->begin))
+	  continue;
+
+	local_progress.start (cu->begin);
+	for (cu_walk walk (dw, *cu, pol.pc_ranges); walk.valid ();
+	     walk.next ())
+	  {
+	    elfutils::all_dies_iterator &it = walk.it ();
+	    std::bitset <count_die_types> die_type;
+	    Dwarf_Die *die = *it;
+	    local_progress.die (dwarf_dieoffset (die));
+
+	    unsigned loc_name = 0;
+	    locstat_error err;
+	    die_action a = select_die (pol, it, die_type, loc_name, err);
+	    if (a == da_skip)
+	      continue;
+
+	    // Errors are passed down the pipeline as well, so that they
+	    // are reported in order.
+	    scope_offs.clear ();
+	    if (a == da_ok)
+	      scopes.find (it, die, scope_offs);
+	    pipeline.add (it, die, a, err, scope_offs, loc_name, die_type);
+	  }
+
+	local_progress.done (cu->end);
+	pipeline.end_cu (*cu);
+      }
+
+    pipeline.finish ();
+    result.expired = cu != cus.end ();
+    return result;
+  }
+}
+
+locstat_result
+locstat_analyze (Dwarf *dw, locstat_options const &opts,
+		 locstat_visitor *visitor)
+{
+  policy pol (opts);
+
+  progress_meter no_progress (dw, false);
+  progress_meter &progress
+    = opts.progress != NULL ? *opts.progress : no_progress;
+
+  if (opts.workers.empty ())
+    return analyze_serial (dw, pol, progress, visitor);
+  else
+    return analyze_pipelined (dw, pol, progress, opts.workers, visitor);
+}
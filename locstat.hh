@@ -0,0 +1,355 @@
+/*
+   Copyright (C) 2010, 2011, 2012, 2015 Red Hat, Inc.
+   This file is part of dwlocstat.
+
+   This file is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   elfutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#ifndef DWLOCSTAT_LOCSTAT_HH
+#define DWLOCSTAT_LOCSTAT_HH
+
+// This is the analysis core of dwlocstat, usable as a library.  It
+// has no global state: everything it needs comes in
+// locstat_options, and everything it finds goes out through
+// locstat_visitor and locstat_result.  Independent analyses can thus
+// run concurrently on separate threads, as long as each has its own
+// Dwarf handle.
+
+#include <bitset>
+#include <chrono>
+#include <set>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <elfutils/libdw.h>
+
+#include "iterators.hh"
+
+namespace elfutils
+{
+  using ::all_dies_iterator;
+  using ::cu_iterator;
+}
+
+class progress_meter;
+
+#define DIE_TYPES		\
+  TYPE (single_addr)		\
+  TYPE (artificial)		\
+  TYPE (inlined)		\
+  TYPE (inlined_subroutine)	\
+  TYPE (no_coverage)		\
+  TYPE (mutable)		\
+  TYPE (immutable)		\
+  TYPE (implicit_pointer)
+
+template <class T>
+struct counter
+{
+  enum { value = T::value + 1 };
+};
+
+template <>
+struct counter <void>
+{
+  enum { value = 1 };
+};
+
+#define TYPE(T) dt_##T,
+enum die_type
+  {
+    DIE_TYPES
+  };
+#undef TYPE
+
+enum
+  {
+#define TYPE(T) counter <
+    count_die_types = DIE_TYPES
+#undef TYPE
+#define TYPE(T) >
+    void DIE_TYPES::value,
+#undef TYPE
+  };
+
+class die_type_matcher
+  : public std::bitset <count_die_types>
+{
+  die_type
+  parse (std::string &desc)
+  {
+#define TYPE(T)		\
+    if (desc == #T)	\
+      return dt_##T;
+    DIE_TYPES
+#undef TYPE
+
+    throw std::runtime_error ("Invalid DIE type `" + desc + "'");
+  }
+
+public:
+  die_type_matcher (std::string const &rule = "")
+  {
+    std::stringstream ss;
+    ss << rule;
+
+    for (std::string item; std::getline (ss, item, ','); )
+      set (parse (item));
+  }
+};
+
+// Sharp 0.0% coverage (i.e. not a single address byte is covered)
+const int cov_00 = -1;
+
+// Histogram of coverage.  Coverage is cov_00..100, where 0..100 is
+// rounded-down integer division.
+class histogram
+{
+  unsigned long m_counts[102];
+  unsigned long m_total;
+
+public:
+  histogram ()
+    : m_total (0)
+  {
+    std::fill (m_counts, m_counts + 102, 0);
+  }
+
+  void
+  add (int coverage, unsigned long count = 1)
+  {
+    m_counts[coverage - cov_00] += count;
+    m_total += count;
+  }
+
+  unsigned long
+  at (int coverage) const
+  {
+    return m_counts[coverage - cov_00];
+  }
+
+  unsigned long
+  total () const
+  {
+    return m_total;
+  }
+};
+
+typedef std::vector <std::pair <Dwarf_Addr, Dwarf_Addr> > ranges_t;
+
+ranges_t die_ranges (Dwarf_Die *die);
+
+// Like the above, but store the ranges to RET, reusing its storage.
+void die_ranges (Dwarf_Die *die, ranges_t &ret);
+
+// What the analysis reports about each DIE that makes it to the
+// tally.
+struct die_info
+{
+  elfutils::all_dies_iterator const &it;
+  Dwarf_Die *die;
+  std::bitset <count_die_types> const &die_type;
+  int coverage;
+
+  // Addresses of DIE's scope, and those of them that are covered by
+  // location expressions.  COVERED is only filled in on request.
+  ranges_t const &scope;
+  ranges_t const &covered;
+};
+
+struct locstat_options
+{
+  // DIEs of these classes are skipped.
+  die_type_matcher ignore;
+
+  // Classes that should be determined for each DIE, so that they
+  // show in die_info::die_type.  Classes in IGNORE are always
+  // determined.
+  std::bitset <count_die_types> classify;
+
+  // Consider addresses covered by DW_OP_GNU_implicit_pointer covered,
+  // instead of looking at the location of the referenced DIE.
+  bool ignore_implicit_pointer;
+
+  // Compute die_info::covered.
+  bool want_covered;
+
+  // Where to report progress, or NULL.
+  progress_meter *progress;
+
+  // Dwarf handles for the same file as the one being analyzed, one
+  // for each coverage worker.  When there are any, DIE traversal and
+  // coverage computation run in a pipeline, with coverage computed
+  // on the worker threads.  The handles must not be used by anyone
+  // else during the analysis.
+  std::vector <Dwarf *> workers;
+
+  // When to stop analyzing further CUs.  If set, CUs are analyzed in
+  // a pseudo-random order, so that the part that is done by the
+  // deadline is a fair sample of the whole file.
+  std::chrono::steady_clock::time_point deadline;
+
+  // CUs whose headers are at these offsets are not analyzed, e.g.
+  // because their results were restored from a checkpoint.  They
+  // still count toward the totals in locstat_result.
+  std::set <Dwarf_Off> skip_cus;
+
+  // Only analyze CUs of shard SHARD (counted from 0) out of SHARDS.
+  // CUs are assigned to shards so that each gets about the same
+  // amount of .debug_info.  The assignment only depends on the file,
+  // so the shards can be analyzed independently, and their results
+  // merged.  Like skipped CUs, CUs of other shards count toward the
+  // totals.
+  unsigned shard;
+  unsigned shards;
+
+  // If not empty, only subprograms with these names, and DIEs nested
+  // in them, are analyzed.  The subprograms are looked up with
+  // find_functions, and only the CUs that define them count toward
+  // the totals in locstat_result.
+  std::set <std::string> functions;
+
+  // If not empty, only DIEs in scopes that overlap these addresses
+  // are analyzed, and their coverage is computed over the overlap
+  // only.  CUs and DIEs with ranges, such as subprograms and lexical
+  // blocks, whose addresses are all outside are skipped without
+  // looking inside.  Only the CUs whose code overlaps the addresses
+  // count toward the totals in locstat_result.
+  ranges_t pc_ranges;
+
+  locstat_options ()
+    : ignore_implicit_pointer (false)
+    , want_covered (false)
+    , progress (NULL)
+    , deadline (std::chrono::steady_clock::time_point::max ())
+    , shard (0)
+    , shards (1)
+  {}
+};
+
+// Why a DIE couldn't be analyzed.
+struct locstat_error
+{
+  // What failed, typically a libdw function.  A static string.
+  char const *what;
+
+  // Attribute involved in the failure, or 0.
+  unsigned attr;
+
+  // libdw error message, or NULL.  A static string.
+  char const *detail;
+
+  locstat_error (char const *a_what = NULL, unsigned a_attr = 0,
+		 char const *a_detail = NULL)
+    : what (a_what)
+    , attr (a_attr)
+    , detail (a_detail)
+  {}
+
+  bool operator== (locstat_error const &other) const;
+};
+
+std::ostream &operator<< (std::ostream &os, locstat_error const &err);
+
+struct locstat_result;
+
+class locstat_visitor
+{
+public:
+  virtual ~locstat_visitor () {}
+
+  // Called for each DIE that makes it to the tally.
+  virtual void die (die_info const &info) = 0;
+
+  // Called for each DIE that couldn't be analyzed.  The DIE is
+  // skipped.
+  virtual void
+  error (Dwarf_Die *die, locstat_error const &err)
+  {}
+
+  // Called before the CU whose header is at CU_OFF is analyzed.
+  // If this returns false, the CU is skipped as if it was in
+  // locstat_options::skip_cus.  This way, several analyses can
+  // divide the CUs among themselves as they go.
+  virtual bool
+  want_cu (Dwarf_Off cu_off)
+  {
+    return true;
+  }
+
+  // Called when all DIEs of the CU whose header is at CU_OFF were
+  // reported.  RESULT is the result of the analysis so far.
+  virtual void
+  cu_done (Dwarf_Off cu_off, locstat_result const &result)
+  {}
+};
+
+// DIEs that couldn't be analyzed for the same reason.
+struct locstat_error_kind
+{
+  locstat_error error;
+  unsigned long count;
+
+  // Offsets of the first few of the DIEs.
+  std::vector <Dwarf_Off> examples;
+};
+
+struct locstat_result
+{
+  histogram tally;
+
+  // Number of DIEs that couldn't be analyzed, in total and by kind.
+  unsigned long errors;
+  std::vector <locstat_error_kind> error_kinds;
+
+  // Number of CUs and .debug_info bytes that were analyzed, out of
+  // how many there are.  These differ if the deadline passed, or if
+  // some CUs were skipped or belong to other shards.
+  unsigned long cus;
+  unsigned long cus_total;
+  uint64_t bytes;
+  uint64_t bytes_total;
+
+  // Whether the deadline passed before all CUs were analyzed.
+  bool expired;
+
+  locstat_result ()
+    : errors (0)
+    , cus (0)
+    , cus_total (0)
+    , bytes (0)
+    , bytes_total (0)
+    , expired (false)
+  {}
+
+  bool
+  partial () const
+  {
+    return cus < cus_total;
+  }
+
+  void add_error (locstat_error const &err, Dwarf_Off die_off);
+
+  // Add OTHER, a result of analyzing CUs that come after those of
+  // this result in the order of analysis.
+  void merge (locstat_result const &other);
+};
+
+// Go through all variables and parameters in DW and compute their
+// coverage.  VISITOR, if not NULL, is told about each of them.
+locstat_result locstat_analyze (Dwarf *dw, locstat_options const &opts,
+				locstat_visitor *visitor);
+
+#endif /* DWLOCSTAT_LOCSTAT_HH */
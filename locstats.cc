@@ -21,21 +21,35 @@
 #include <libintl.h>
 #include <algorithm>
 #include <iostream>
-#include <map>
+#include <set>
+#include <deque>
+#include <array>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
 #include <cstdio>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 #include <dwarf.h>
 #include <argp.h>
+#include <gelf.h>
+#include <elfutils/libdwelf.h>
 
+#include "archives.hh"
 #include "files.hh"
+#include "progress.hh"
 #include "dwarfstrings.h"
-#include "iterators.hh"
-
-namespace elfutils
-{
-  using ::all_dies_iterator;
-  using ::cu_iterator;
-}
+#include "locstat.hh"
+#include "queue.hh"
 
 static void print_version (FILE *stream, struct argp_state *state);
 
@@ -46,6 +60,23 @@ enum
     OPT_DUMP,
     OPT_TABULATE,
     OPT_IGNORE_IMPLICIT_POINTER,
+    OPT_FILES_FROM,
+    OPT_STATUS,
+    OPT_GROUP_BY,
+    OPT_WORST,
+    OPT_DIFF,
+    OPT_PC_MAP,
+    OPT_DUMP_FILE,
+    OPT_DEADLINE,
+    OPT_CHECKPOINT,
+    OPT_RESUME,
+    OPT_SHARD,
+    OPT_SAVE,
+    OPT_MERGE,
+    OPT_PROCS,
+    OPT_PREFETCH,
+    OPT_FUNCTION,
+    OPT_PC_RANGE,
   };
 
 /* Definitions of arguments for argp functions.  */
@@ -57,6 +88,9 @@ static const struct argp_option options[] =
   { "dump", OPT_DUMP, "CLASS", 0,
     "Dump certain DIEs.  See below for available classes.", 0 },
 
+  { "dump-file", OPT_DUMP_FILE, "FILE", 0,
+    "Write output of --dump to FILE instead of standard error.", 0 },
+
   { "CLASS", 0, NULL, OPTION_DOC,
     "May be one of single_addr, artificial, inlined, "
     "inlined_subroutine, no_coverage, mutable, immutable, "
@@ -67,26 +101,126 @@ static const struct argp_option options[] =
     "or special value 0.0 indicating cases with no coverage whatsoever "
     "(i.e. not those that happen to round to 0%).", 0 },
 
+  { "group-by", OPT_GROUP_BY, "KEY[,...]", 0,
+    "In addition to the overall histogram, show histograms of groups "
+    "of DIEs that share the given KEYs.  KEY may be one of cu, producer, "
+    "function, tag, class.", 0 },
+
+  { "worst", OPT_WORST, "N", 0,
+    "With --group-by, only show N groups with the worst coverage.  "
+    "With --diff, show N worst regressions (default 10).", 0 },
+
+  { "diff", OPT_DIFF, NULL, 0,
+    "Compare coverage of two builds.  Takes two files, OLD and NEW.", 0 },
+
+  { "pc-map", OPT_PC_MAP, "FUNCTION[,...]", OPTION_ARG_OPTIONAL,
+    "For each address range, show how many variables are in scope, and "
+    "how many of those have location.  Optionally show only ranges in "
+    "given functions.", 0 },
+
   { "show-progress", 'p', NULL, 0, "Show progress.", 0 },
 
+  { "verbose", 'v', NULL, 0,
+    "Report each DIE that couldn't be analyzed, instead of a summary "
+    "by kind of error.", 0 },
+
+  { "jobs", 'j', "N", 0,
+    "Compute coverage on N worker threads, while the main thread walks "
+    "the DIE tree.  For archives, analyze N members at a time.", 0 },
+
+  { "procs", OPT_PROCS, "N", 0,
+    "Analyze the file in N processes, forked after it is opened.  Unlike "
+    "--jobs, this doesn't need a thread-safe libdw.", 0 },
+
+  { "deadline", OPT_DEADLINE, "SECONDS", 0,
+    "Stop analyzing further CUs SECONDS after start, and report what "
+    "was done by then.  CUs are then visited in a pseudo-random order, "
+    "so that the partial result is a fair sample.", 0 },
+
+  { "checkpoint", OPT_CHECKPOINT, "FILE", 0,
+    "Periodically save which CUs are done and their results to FILE.", 0 },
+
+  { "resume", OPT_RESUME, NULL, 0,
+    "Skip CUs that the --checkpoint FILE records as done, and "
+    "continue from the results saved there.", 0 },
+
+  { "shard", OPT_SHARD, "K/N", 0,
+    "Only analyze the K-th of N parts of the file.  The parts have "
+    "about the same size, and can be analyzed independently.", 0 },
+
+  { "save", OPT_SAVE, "FILE", 0,
+    "Save the histogram and error summary to FILE, for --merge.", 0 },
+
+  { "merge", OPT_MERGE, NULL, 0,
+    "Combine results saved by --save, e.g. those of all shards of a file, "
+    "and show them.  Takes the saved FILEs.", 0 },
+
+  { "function", OPT_FUNCTION, "NAME[,...]", 0,
+    "Only analyze the named functions.  They are looked up in "
+    ".debug_names or .gdb_index, if the file has either.", 0 },
+
+  { "pc-range", OPT_PC_RANGE, "LO-HI[,...]", 0,
+    "Only analyze variables in scopes that overlap the given hexadecimal "
+    "address ranges, and only count coverage of those addresses.  A "
+    "single address may be given instead of a range.", 0 },
+
   { "ignore-implicit-pointer", OPT_IGNORE_IMPLICIT_POINTER, NULL, 0,
     "Turn off special handling of DW_OP_GNU_implicit_pointer.", 0 },
 
+  { "files-from", OPT_FILES_FROM, "FILE", 0,
+    "Read names of files to process from FILE, one per line.  "
+    "If FILE is -, read standard input.", 0 },
+
+  { "status", OPT_STATUS, "FILE", 0,
+    "Append a status record for each processed file to FILE.  Files "
+    "already recorded as done in FILE are skipped.", 0 },
+
+  { "prefetch", OPT_PREFETCH, "MIB", 0,
+    "When processing several files, read ahead debug sections of the "
+    "next ones, up to MIB megabytes at a time.  0 turns read-ahead "
+    "off.  The default is 64.", 0 },
+
   { NULL, 0, NULL, 0, NULL, 0 },
 };
 
 std::string opt_tabulate = "10:10";
 std::string opt_ignore = "";
 std::string opt_dump = "";
+std::string opt_dump_file = "";
 bool opt_ignore_implicit_pointer = false;
 bool opt_show_progress = false;
+bool opt_verbose = false;
+std::string opt_files_from = "";
+std::string opt_status = "";
+std::string opt_group_by = "";
+unsigned opt_worst = 0;
+bool opt_diff = false;
+bool opt_pc_map = false;
+std::string opt_pc_map_functions = "";
+unsigned opt_jobs = 0;
+unsigned opt_procs = 0;
+double opt_deadline = -1;
+std::string opt_checkpoint = "";
+bool opt_resume = false;
+unsigned opt_shard = 1;
+unsigned opt_shards = 1;
+std::string opt_save = "";
+bool opt_merge = false;
+unsigned long opt_prefetch = 64;
+std::string opt_function = "";
+std::string opt_pc_range = "";
+ranges_t opt_pc_ranges;
+
+// When processing started, for --deadline.
+std::chrono::steady_clock::time_point start_time
+  = std::chrono::steady_clock::now ();
 
 /* Short description of program.  */
 static const char doc[] = "\
 Examine coverage of variable lifetime by location expressions.";
 
 /* Strings for arguments in help texts.  */
-static const char args_doc[] = "FILE...";
+static const char args_doc[] = "[FILE...]\n--diff OLD NEW\n--merge SAVED...";
 
 /* Prototype for option handler.  */
 static error_t parse_opt (int key, char *arg, struct argp_state *state);
@@ -97,17 +231,6 @@ static struct argp argp =
   options, parse_opt, args_doc, doc, NULL, NULL, NULL
 };
 
-
-#define DIE_TYPES		\
-  TYPE (single_addr)		\
-  TYPE (artificial)		\
-  TYPE (inlined)		\
-  TYPE (inlined_subroutine)	\
-  TYPE (no_coverage)		\
-  TYPE (mutable)		\
-  TYPE (immutable)		\
-  TYPE (implicit_pointer)
-
 struct tabrule
 {
   int start;
@@ -125,9 +248,6 @@ struct tabrule
   }
 };
 
-// Sharp 0.0% coverage (i.e. not a single address byte is covered)
-const int cov_00 = -1;
-
 struct tabrules_t
   : public std::vector <tabrule>
 {
@@ -210,669 +330,2242 @@ struct tabrules_t
   }
 };
 
-template <class T>
-struct counter
+// One line of tabulated histogram.  Covers coverage LOW..HIGH.
+struct bucket
 {
-  enum { value = T::value + 1 };
+  int low;
+  int high;
+  unsigned long samples;
+  unsigned long cumulative;
 };
 
-template <>
-struct counter <void>
+std::ostream &
+operator<< (std::ostream &os, bucket const &b)
 {
-  enum { value = 1 };
-};
+  if (b.low == cov_00)
+    os << "0.0";
+  else
+    os << std::dec << b.low;
+
+  if (b.low != b.high)
+    os << ".." << b.high;
+  return os;
+}
+
+std::vector <bucket>
+tabulate (histogram const &hist, tabrules_t tabrules)
+{
+  std::vector <bucket> ret;
+  unsigned long cumulative = 0;
+  unsigned long last = 0;
+  int last_pct = cov_00;
+
+  for (int i = cov_00; i <= 100; ++i)
+    {
+      cumulative += hist.at (i);
+      if (tabrules.match (i))
+	{
+	  // The case 0.0..x should be printed simply as 0
+	  if (last_pct == cov_00 && i > cov_00)
+	    last_pct = 0;
+
+	  bucket b = { last_pct, i, cumulative - last, cumulative };
+	  ret.push_back (b);
+	  last = cumulative;
+	  last_pct = i + 1;
+
+	  tabrules.next ();
+	}
+    }
+
+  return ret;
+}
 
-#define TYPE(T) dt_##T,
-enum die_type
+namespace pri
+{
+  struct ref
   {
-    DIE_TYPES
+    Dwarf_Off const off;
+
+    ref (Dwarf_Die *die)
+      : off (dwarf_dieoffset (die))
+    {}
+
+    ref (Dwarf_Off a_off)
+      : off (a_off)
+    {}
   };
-#undef TYPE
 
-enum
+  std::ostream &
+  operator<< (std::ostream &os, ref const &obj)
   {
-#define TYPE(T) counter <
-    count_die_types = DIE_TYPES
-#undef TYPE
-#define TYPE(T) >
-    void DIE_TYPES::value,
-#undef TYPE
+    return os << std::hex << "DIE " << obj.off;
+  }
+}
+
+#define GROUP_KEYS		\
+  KEY (cu)			\
+  KEY (producer)		\
+  KEY (function)		\
+  KEY (tag)			\
+  KEY (class)
+
+#define KEY(K) gk_##K,
+enum group_key
+  {
+    GROUP_KEYS
+    count_group_keys
   };
+#undef KEY
 
-class die_type_matcher
-  : public std::bitset <count_die_types>
+// Histograms of DIEs grouped by CU, function, etc.  Key values are
+// interned, so that a group is identified by a small array of
+// integers.  The histograms themselves live in one flat array, one
+// row per group.
+class groups_t
 {
-  die_type
-  parse (std::string &desc)
+  typedef std::array <uint32_t, count_group_keys> key_t;
+
+  struct key_hash
   {
-#define TYPE(T)		\
-    if (desc == #T)	\
-      return dt_##T;
-    DIE_TYPES
-#undef TYPE
+    size_t
+    operator() (key_t const &key) const
+    {
+      size_t h = 0;
+      for (size_t i = 0; i < key.size (); ++i)
+	h = h * 0x9e3779b1 + key[i];
+      return h;
+    }
+  };
+
+  static size_t const row_size = 102;
+
+  std::vector <group_key> m_keys;
+  std::vector <std::string> m_strings;
+  std::unordered_map <std::string, uint32_t> m_string_ids;
+  std::unordered_map <key_t, uint32_t, key_hash> m_group_ids;
+  std::vector <key_t> m_group_keys;
+  std::vector <uint32_t> m_counts;
+
+  // Keys of the last DIE.  Consecutive DIEs tend to come from the
+  // same CU and function, so most of the time we don't need to look
+  // the strings up again.
+  Dwarf_Off m_cu_off;
+  Dwarf_Off m_parent_off;
+  key_t m_last_key;
+  uint32_t m_last_group;
+
+  static group_key
+  parse (std::string const &desc)
+  {
+#define KEY(K)			\
+    if (desc == #K)		\
+      return gk_##K;
+    GROUP_KEYS
+#undef KEY
 
-    throw std::runtime_error ("Invalid DIE type `" + desc + "'");
+    throw std::runtime_error ("Invalid group key `" + desc + "'");
   }
 
-public:
-  die_type_matcher (std::string const &rule)
+  static char const *
+  key_name (group_key key)
   {
-    std::stringstream ss;
-    ss << rule;
-
-    for (std::string item; std::getline (ss, item, ','); )
-      set (parse (item));
+    switch (key)
+      {
+#define KEY(K) case gk_##K: return #K;
+	GROUP_KEYS
+#undef KEY
+      case count_group_keys:
+	break;
+      }
+    return "???";
   }
-};
 
-typedef std::vector <std::pair <Dwarf_Addr, Dwarf_Addr> > ranges_t;
+  uint32_t
+  intern (char const *str)
+  {
+    std::string s = str != NULL ? str : "???";
+    std::unordered_map <std::string, uint32_t>::iterator it
+      = m_string_ids.find (s);
+    if (it != m_string_ids.end ())
+      return it->second;
+
+    uint32_t id = m_strings.size ();
+    m_strings.push_back (s);
+    m_string_ids.insert (std::make_pair (s, id));
+    return id;
+  }
 
-enum die_action
+  static char const *
+  string_attr (Dwarf_Die *die, unsigned attr_name)
   {
-    da_ok = 0,
-    da_fail,
-    da_skip,
-  };
+    Dwarf_Attribute attr_mem,
+      *attr = dwarf_attr_integrate (die, attr_name, &attr_mem);
+    return attr != NULL ? dwarf_formstring (attr) : NULL;
+  }
 
-class mutability_t;
+  uint32_t
+  function_id (elfutils::all_dies_iterator const &it)
+  {
+    for (size_t n = 1; n <= it.depth (); ++n)
+      {
+	Dwarf_Die die;
+	it.ancestor (n, die);
+	if (dwarf_tag (&die) == DW_TAG_subprogram)
+	  return intern (string_attr (&die, DW_AT_name));
+      }
+    return intern ("<global>");
+  }
 
-static die_action process_location (Dwarf_Attribute *locattr,
-				    ranges_t const &ranges,
-				    bool interested_mutability,
-				    bool interested_implicit,
-				    bool full_implicit,
-				    std::bitset <count_die_types> &die_type,
-				    mutability_t &mut,
-				    int &coverage);
+  uint32_t
+  class_id (std::bitset <count_die_types> const &die_type)
+  {
+    std::string desc;
+#define TYPE(T)						\
+    if (die_type.test (dt_##T))				\
+      desc += (desc.empty () ? "" : "+") + std::string (#T);
+    DIE_TYPES
+#undef TYPE
+    return intern (desc.empty () ? "-" : desc.c_str ());
+  }
 
-static die_action process_implicit_pointer (Dwarf_Attribute *locattr,
-					    Dwarf_Op *op,
-					    ranges_t const &ranges,
-					    bool interested_mutability,
-					    bool interested_implicit,
-					    std::bitset <count_die_types> &die_type,
-					    mutability_t &mut,
-					    int &coverage);
+  histogram
+  group_histogram (uint32_t group) const
+  {
+    histogram ret;
+    for (int i = cov_00; i <= 100; ++i)
+      ret.add (i, m_counts[group * row_size + i - cov_00]);
+    return ret;
+  }
 
-class mutability_t
-{
-  bool _m_is_mutable;
-  bool _m_is_immutable;
+  // Mean coverage of the group.  Sharp zero counts as 0%.
+  static double
+  mean (histogram const &hist)
+  {
+    unsigned long sum = 0;
+    for (int i = 0; i <= 100; ++i)
+      sum += (unsigned long)i * hist.at (i);
+    return hist.total () > 0 ? (double)sum / hist.total () : 0;
+  }
 
 public:
-  mutability_t ()
-    : _m_is_mutable (false)
-    , _m_is_immutable (false)
+  explicit groups_t (std::string const &rule)
+    : m_cu_off ((Dwarf_Off)-1)
+    , m_parent_off ((Dwarf_Off)-1)
+    , m_last_group ((uint32_t)-1)
   {
+    std::stringstream ss;
+    ss << rule;
+
+    for (std::string item; std::getline (ss, item, ','); )
+      m_keys.push_back (parse (item));
+
+    m_last_key.fill ((uint32_t)-1);
   }
 
-  void set (bool what)
+  bool
+  empty () const
   {
-    if (what)
-      _m_is_mutable = true;
-    else
-      _m_is_immutable = true;
+    return m_keys.empty ();
   }
 
-  void set_both ()
+  bool
+  has (group_key key) const
   {
-    set (true);
-    set (false);
+    return std::find (m_keys.begin (), m_keys.end (), key) != m_keys.end ();
   }
 
-  die_action
-  locexpr (Dwarf_Attribute *attr, ranges_t const &ranges,
-	   Dwarf_Op *expr, size_t len, bool full_implicit)
+  void
+  add (elfutils::all_dies_iterator const &it, Dwarf_Die *die,
+       std::bitset <count_die_types> const &die_type, int coverage)
   {
-    // We scan the expression looking for DW_OP_{bit_,}piece operators
-    // which mark ends of sub-expressions to us.  Some operators
-    // describe the object value instead its location: these are
-    // immutable.
-    bool m = true;
-    for (size_t i = 0; i < len; ++i)
-      switch (expr[i].atom)
-	{
-	case DW_OP_implicit_value:
-	case DW_OP_stack_value:
-	  m = false;
-	  break;
+    key_t key = m_last_key;
 
-	case DW_OP_bit_piece:
-	case DW_OP_piece:
-	  set (m);
-	  m = true;
-	  break;
+    elfutils::cu_iterator cit = it.cu ();
+    Dwarf_Off cu_off = dwarf_dieoffset (*cit);
+    if (cu_off != m_cu_off)
+      {
+	m_cu_off = cu_off;
+	m_parent_off = (Dwarf_Off)-1;
+	if (has (gk_cu))
+	  key[gk_cu] = intern (dwarf_diename (*cit));
+	if (has (gk_producer))
+	  key[gk_producer] = intern (string_attr (*cit, DW_AT_producer));
+      }
 
-	case DW_OP_GNU_entry_value:
-	  // This evaluates its argument as location expression, with
-	  // registers having values as they had on entry to current
-	  // function.  It says nothing about how the value is used,
-	  // so it's just a complex way of computing some constant.
-	  // Thus it can be either mutable or immutable.
-	  break;
+    if (has (gk_function) && it.parent_offset () != m_parent_off)
+      {
+	m_parent_off = it.parent_offset ();
+	key[gk_function] = function_id (it);
+      }
 
-	case DW_OP_GNU_implicit_pointer:
-	  if (! full_implicit)
-	    {
-	      set_both ();
-	      return da_ok;
-	    }
+    if (has (gk_tag))
+      key[gk_tag] = intern (dwarf_tag_string (dwarf_tag (die)));
 
-	  // Mutability of implicit pointer depends on mutability of
-	  // referenced expression.  We don't want referenced DIE's
-	  // type to surface at this DIE, and we can therefore pass
-	  // false to interested_implicit.
-	  std::bitset <count_die_types> ref_die_type;
-	  int coverage = 0;
-	  if (die_action a = (process_implicit_pointer
-			      (attr, expr + i, ranges,
-			       true, false,
-			       ref_die_type, *this, coverage)))
-	    return a;
-
-	  // The location was valid.  This ought to be the only
-	  // operand.
-	  return da_ok;
-	};
-
-    set (m);
-    return da_ok;
-  }
-
-  bool is_mutable () const { return _m_is_mutable; }
-  bool is_immutable () const { return _m_is_immutable; }
-};
+    if (has (gk_class))
+      key[gk_class] = class_id (die_type);
 
-ranges_t
-die_ranges (Dwarf_Die *die)
-{
-  Dwarf_Addr base;
-  Dwarf_Addr start, end;
-  ranges_t ret;
-  for (ptrdiff_t it = 0;
-       (it = dwarf_ranges (die, it, &base, &start, &end)) != 0; )
-    ret.push_back (std::make_pair (start, end));
-  return ret;
-}
+    if (key != m_last_key)
+      {
+	std::pair <std::unordered_map <key_t, uint32_t, key_hash>::iterator,
+		   bool> ins
+	  = m_group_ids.insert (std::make_pair (key, m_group_keys.size ()));
+	if (ins.second)
+	  {
+	    m_group_keys.push_back (key);
+	    m_counts.resize (m_counts.size () + row_size);
+	  }
+	m_last_key = key;
+	m_last_group = ins.first->second;
+      }
 
-// Look through parental dies and return the non-empty ranges instance
-// closest to IT hierarchically.
-ranges_t
-find_ranges (elfutils::all_dies_iterator it)
-{
-  for (; it != elfutils::all_dies_iterator::end (); it = it.parent ())
-    {
-      ranges_t ranges = die_ranges (*it);
-      if (! ranges.empty ())
-	return ranges;
-    }
+    m_counts[m_last_group * row_size + coverage - cov_00]++;
+  }
 
-  throw std::runtime_error ("no ranges at this or parental DIEs");
-}
+  // Print tabulated histogram of each group.  If WORST is non-zero,
+  // only print that many groups with the lowest mean coverage.
+  void
+  print (tabrules_t const &tabrules, unsigned worst) const
+  {
+    std::vector <std::string> names;
+    std::vector <histogram> hists;
+    std::vector <double> means;
+    std::vector <uint32_t> order;
+    for (uint32_t i = 0; i < m_group_keys.size (); ++i)
+      {
+	std::string name;
+	for (size_t j = 0; j < m_keys.size (); ++j)
+	  name += (j > 0 ? "\t" : "") + m_strings[m_group_keys[i][m_keys[j]]];
+	names.push_back (name);
+	hists.push_back (group_histogram (i));
+	means.push_back (mean (hists.back ()));
+	order.push_back (i);
+      }
 
-static die_action
-process_implicit_pointer (Dwarf_Attribute *locattr,
-			  Dwarf_Op *op,
-			  ranges_t const &ranges,
-			  bool interested_mutability,
-			  bool interested_implicit,
-			  std::bitset <count_die_types> &die_type,
-			  mutability_t &mut,
-			  int &coverage)
-{
-  // For implicit pointer, we are actually interested in how location
-  // expressions on target DIE cover this DIE's addresses.
-  Dwarf_Attribute ref_attr;
-  if (dwarf_getlocation_implicit_pointer (locattr, op, &ref_attr) < 0)
-    {
-      // No location expression at referenced DIE.  That means
-      // this location expression is itself empty.
-      coverage = cov_00;
-      return da_ok;
-    }
-
-  return process_location (&ref_attr, ranges, interested_mutability,
-			   interested_implicit, true, die_type, mut, coverage);
-}
+    // Sort by names first, so that the output doesn't depend on the
+    // order in which the groups were encountered.
+    std::sort (order.begin (), order.end (),
+	       [&names] (uint32_t a, uint32_t b)
+	       { return names[a] < names[b]; });
+    if (worst > 0)
+      {
+	std::stable_sort (order.begin (), order.end (),
+			  [&means] (uint32_t a, uint32_t b)
+			  { return means[a] < means[b]; });
+	if (order.size () > worst)
+	  order.resize (worst);
+      }
+
+    std::cout << std::endl;
+    for (size_t j = 0; j < m_keys.size (); ++j)
+      std::cout << key_name (m_keys[j]) << "\t";
+    std::cout << "samples\tmean%";
+    std::vector <bucket> header = tabulate (histogram (), tabrules);
+    for (std::vector <bucket>::const_iterator jt = header.begin ();
+	 jt != header.end (); ++jt)
+      std::cout << "\t" << *jt;
+    std::cout << std::endl;
+
+    for (std::vector <uint32_t>::const_iterator it = order.begin ();
+	 it != order.end (); ++it)
+      {
+	char mean_buf[16];
+	std::snprintf (mean_buf, sizeof mean_buf, "%.1f", means[*it]);
+	std::cout << names[*it] << "\t" << std::dec << hists[*it].total ()
+		  << "\t" << mean_buf;
+
+	std::vector <bucket> buckets = tabulate (hists[*it], tabrules);
+	for (std::vector <bucket>::const_iterator jt = buckets.begin ();
+	     jt != buckets.end (); ++jt)
+	  std::cout << "\t" << jt->samples;
+	std::cout << std::endl;
+      }
+  }
+};
 
-static die_action
-process_location (Dwarf_Attribute *locattr,
-		  ranges_t const &ranges,
-		  bool interested_mutability,
-		  bool interested_implicit,
-		  bool full_implicit,
-		  std::bitset <count_die_types> &die_type,
-		  mutability_t &mut,
-		  int &coverage)
+// Map from address ranges to number of variables whose scope covers
+// the range, and number of those that have location there.  Built by
+// a sweep over endpoints of scope and covered ranges of analyzed
+// DIEs, so the cost depends on number of ranges, not their sizes.
+class pc_map
 {
-  Dwarf_Op *expr;
-  size_t len;
+  struct event
+  {
+    Dwarf_Addr addr;
+    int scope;
+    int covered;
 
-  // no location
-  if (locattr == NULL)
+    bool
+    operator< (event const &other) const
     {
-      coverage = cov_00;
-      if (interested_mutability)
-	mut.set_both ();
+      return addr < other.addr;
     }
+  };
 
-  // consts need no location
-  else if (dwarf_whatattr (locattr) == DW_AT_const_value)
-    {
-      coverage = 100;
-      if (interested_mutability)
-	mut.set (false);
-    }
+  struct run
+  {
+    Dwarf_Addr low;
+    Dwarf_Addr high;
+    unsigned scope;
+    unsigned covered;
+  };
 
-  // non-list location
-  else if (dwarf_getlocation (locattr, &expr, &len) == 0)
-    {
-      if (len == 1 && expr[0].atom == DW_OP_addr)
-	// Globals and statics have non-list location that is a
-	// singleton DW_OP_addr expression.
-	die_type.set (dt_single_addr);
+  bool m_enabled;
+  std::set <std::string> m_functions;
+  std::vector <event> m_events;
 
-      else if (full_implicit
-	       && len == 1 && expr[0].atom == DW_OP_GNU_implicit_pointer)
-	return process_implicit_pointer (locattr, expr, ranges,
-					 interested_mutability,
-					 interested_implicit,
-					 die_type, mut, coverage);
+  // Requested functions that were actually seen, and their ranges.
+  std::vector <std::pair <std::string, ranges_t> > m_function_ranges;
+  std::set <Dwarf_Off> m_seen_functions;
 
-      if (interested_mutability)
-	if (die_action a = mut.locexpr (locattr, ranges, expr, len,
-					full_implicit))
-	  return a;
-      coverage = (len == 0) ? cov_00 : 100;
-    }
+  // Whether the last parent DIE is in one of requested functions.
+  Dwarf_Off m_parent_off;
+  bool m_in_function;
 
-  // location list
-  else
-    {
-      size_t length = 0;
-      size_t covered = 0;
+  void
+  add_ranges (ranges_t const &ranges, int scope, int covered)
+  {
+    for (ranges_t::const_iterator it = ranges.begin ();
+	 it != ranges.end (); ++it)
+      {
+	event lo = { it->first, scope, covered };
+	event hi = { it->second, -scope, -covered };
+	m_events.push_back (lo);
+	m_events.push_back (hi);
+      }
+  }
 
-      // Arbitrarily assume that there will be no more than 10
-      // expressions per address.
-      size_t nlocs = 10;
-      Dwarf_Op *exprs[nlocs];
-      size_t exprlens[nlocs];
+  bool
+  in_function (elfutils::all_dies_iterator const &it)
+  {
+    for (size_t n = 1; n <= it.depth (); ++n)
+      {
+	Dwarf_Die die;
+	it.ancestor (n, die);
+	if (dwarf_tag (&die) == DW_TAG_subprogram)
+	  {
+	    Dwarf_Attribute attr_mem,
+	      *attr = dwarf_attr_integrate (&die, DW_AT_name, &attr_mem);
+	    char const *name = attr != NULL ? dwarf_formstring (attr) : NULL;
+	    if (name == NULL || m_functions.count (name) == 0)
+	      return false;
+
+	    if (m_seen_functions.insert (dwarf_dieoffset (&die)).second)
+	      m_function_ranges.push_back (std::make_pair (name,
+							   die_ranges (&die)));
+	    return true;
+	  }
+      }
+    return false;
+  }
 
-      for (ranges_t::const_iterator rit = ranges.begin ();
-	   rit != ranges.end (); ++rit)
-	{
-	  Dwarf_Addr low = rit->first;
-	  Dwarf_Addr high = rit->second;
-	  length += high - low;
-	  //std::cerr << " " << low << ".." << high << std::endl;
+  std::vector <run>
+  build () const
+  {
+    std::vector <event> events = m_events;
+    std::sort (events.begin (), events.end ());
 
-	  for (Dwarf_Addr addr = low; addr < high; ++addr)
-	    {
-	      int got = dwarf_getlocation_addr (locattr, addr,
-						exprs, exprlens, nlocs);
-	      if (got < 0)
-		{
-		  std::stringstream ss;
-		  ss << "dwarf_getlocation_addr: " << dwarf_errmsg (-1);
-		  throw std::runtime_error (ss.str ());
-		}
+    std::vector <run> ret;
+    int scope = 0;
+    int covered = 0;
+    for (size_t i = 0; i < events.size (); )
+      {
+	Dwarf_Addr addr = events[i].addr;
+	for (; i < events.size () && events[i].addr == addr; ++i)
+	  {
+	    scope += events[i].scope;
+	    covered += events[i].covered;
+	  }
 
-	      // At least one expression for the address must
-	      // be of non-zero length for us to count that
-	      // address as covered.
-	      bool cover = false;
-	      for (int i = 0; i < got; ++i)
-		{
-		  if (exprlens[i] == 0)
-		    continue;
-
-		  if (interested_mutability)
-		    if (die_action a = mut.locexpr (locattr, ranges,
-						    exprs[i], exprlens[i],
-						    full_implicit))
-		      return a;
-
-		  bool sole_implicit = exprlens[i] == 1
-		    && exprs[i]->atom == DW_OP_GNU_implicit_pointer;
-		  if (! sole_implicit || ! full_implicit)
-		    // Either it's not implicit pointer, or it is, but
-		    // we don't care.
-		    cover = true;
-		  if (sole_implicit && interested_implicit)
-		    die_type.set (dt_implicit_pointer);
-		}
+	if (i == events.size () || scope == 0)
+	  continue;
 
-	      // If the address is uncovered at this point, look again
-	      // for singleton DW_OP_GNU_implicit_pointer's.  We need
-	      // to figure out whether at least one of them covers
-	      // this address.
-	      if (! cover && full_implicit)
-		for (int i = 0; i < got; ++i)
-		  if (exprlens[i] == 1
-		      && exprs[i]->atom == DW_OP_GNU_implicit_pointer)
-		    {
-		      ranges_t this_range;
-		      this_range.push_back (std::make_pair (addr, addr + 1));
-		      int this_coverage;
-		      if (die_action a = (process_implicit_pointer
-					  (locattr, exprs[i], this_range,
-					   interested_mutability,
-					   interested_implicit,
-					   die_type, mut, this_coverage)))
-			{
-			  coverage = cov_00;
-			  return a;
-			}
-		      if (this_coverage == 100)
-			{
-			  cover = true;
-			  break;
-			}
-		    }
-
-	      if (cover)
-		covered++;
-	    }
-	}
+	Dwarf_Addr next = events[i].addr;
+	if (! ret.empty () && ret.back ().high == addr
+	    && ret.back ().scope == (unsigned)scope
+	    && ret.back ().covered == (unsigned)covered)
+	  ret.back ().high = next;
+	else
+	  {
+	    run r = { addr, next, (unsigned)scope, (unsigned)covered };
+	    ret.push_back (r);
+	  }
+      }
 
-      if (length == 0 || covered == 0)
-	coverage = cov_00;
-      else
-	coverage = 100 * covered / length;
-    }
-  return da_ok;
-}
+    return ret;
+  }
 
-bool
-die_flag_value (Dwarf_Die *die, unsigned attr_name)
-{
-  Dwarf_Attribute attr;
-  bool val;
+  static void
+  print_run (run const &r)
+  {
+    std::cout << std::hex << r.low << ".." << r.high << std::dec
+	      << "\t" << r.scope << "\t" << r.covered << std::endl;
+  }
 
-  // XXX do we need dwarf_attr_integrate here?
-  if (dwarf_attr (die, attr_name, &attr) != NULL)
-    {
-      if (dwarf_formflag (&attr, &val) != 0)
-	{
-	  std::stringstream ss;
-	  ss << "dwarf_formflag(" << dwarf_attr_string (attr_name) << "): "
-	     << dwarf_errmsg (-1);
-	  throw std::runtime_error (ss.str ());
-	}
+public:
+  pc_map (bool enabled, std::string const &functions)
+    : m_enabled (enabled)
+    , m_parent_off ((Dwarf_Off)-1)
+    , m_in_function (false)
+  {
+    std::stringstream ss;
+    ss << functions;
 
-      return val;
-    }
-  return false;
-}
+    for (std::string item; std::getline (ss, item, ','); )
+      m_functions.insert (item);
+  }
 
-bool
-is_inlined (Dwarf_Die *die)
-{
-  return die_flag_value (die, DW_AT_inline);
-}
+  bool
+  enabled () const
+  {
+    return m_enabled;
+  }
 
-namespace pri
-{
-  struct ref
+  void
+  add (die_info const &info)
   {
-    Dwarf_Off const off;
+    if (! m_functions.empty ())
+      {
+	if (info.it.parent_offset () != m_parent_off)
+	  {
+	    m_parent_off = info.it.parent_offset ();
+	    m_in_function = in_function (info.it);
+	  }
+	if (! m_in_function)
+	  return;
+      }
 
-    ref (Dwarf_Die *die)
-      : off (dwarf_dieoffset (die))
-    {}
-  };
+    add_ranges (info.scope, 1, 0);
+    add_ranges (info.covered, 0, 1);
+  }
 
-  std::ostream &
-  operator<< (std::ostream &os, ref const &obj)
+  void
+  print () const
   {
-    return os << std::hex << "DIE " << obj.off;
+    std::vector <run> runs = build ();
+
+    std::cout << std::endl << "range\tscope\tcovered" << std::endl;
+    if (m_functions.empty ())
+      {
+	for (std::vector <run>::const_iterator it = runs.begin ();
+	     it != runs.end (); ++it)
+	  print_run (*it);
+	return;
+      }
+
+    for (std::vector <std::pair <std::string, ranges_t> >::const_iterator
+	   it = m_function_ranges.begin ();
+	 it != m_function_ranges.end (); ++it)
+      {
+	std::cout << it->first << ":" << std::endl;
+
+	// Bytes weighted by number of variables in scope, and by
+	// number of variables with location.
+	unsigned long scope_bytes = 0;
+	unsigned long covered_bytes = 0;
+	for (ranges_t::const_iterator rit = it->second.begin ();
+	     rit != it->second.end (); ++rit)
+	  {
+	    run key = { rit->first, rit->first, 0, 0 };
+	    std::vector <run>::const_iterator jt
+	      = std::upper_bound (runs.begin (), runs.end (), key,
+				  [] (run const &a, run const &b)
+				  { return a.low < b.high; });
+	    for (; jt != runs.end () && jt->low < rit->second; ++jt)
+	      {
+		run r = *jt;
+		r.low = std::max (r.low, rit->first);
+		r.high = std::min (r.high, rit->second);
+		print_run (r);
+		scope_bytes += (r.high - r.low) * r.scope;
+		covered_bytes += (r.high - r.low) * r.covered;
+	      }
+	  }
+
+	if (scope_bytes > 0)
+	  std::cout << "covered " << std::dec
+		    << (100 * covered_bytes / scope_bytes)
+		    << "% of in-scope variable bytes" << std::endl;
+      }
   }
+};
+
+// File descriptor where --dump output goes.  The file is opened on
+// first use and shared by all users.
+int
+dump_fd ()
+{
+  static int fd = opt_dump_file.empty () ? STDERR_FILENO
+    : open (opt_dump_file.c_str (), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    throw std::runtime_error ("Couldn't open dump file `"
+			      + opt_dump_file + "': " + strerror (errno));
+  return fd;
 }
 
-void
-process (Dwarf *dw,
-	 die_type_matcher const &ignore, die_type_matcher const &dump)
+// Writer of --dump output.  DIEs are shown as a tree: of the chain of
+// ancestors of each DIE, only the part that differs from that of the
+// previously dumped DIE is printed.  Output is collected in a buffer
+// and written out in large chunks, each ending at a DIE boundary.
+class dump_sink
 {
-  // map percentage->occurrences.  Percentage is cov_00..100, where
-  // 0..100 is rounded-down integer division.
-  std::map <int, unsigned long> tally;
-  unsigned long total = 0;
-  for (int i = 0; i <= 100; ++i)
-    tally[i] = 0;
+  int m_fd;
+  std::string m_buf;
 
-  tabrules_t tabrules (opt_tabulate);
-  std::bitset <count_die_types> interested = ignore | dump;
-  bool interested_mutability
-    = interested.test (dt_mutable) || interested.test (dt_immutable);
-  bool interested_implicit = interested.test (dt_implicit_pointer);
-  bool full_implicit = ! opt_ignore_implicit_pointer;
-
-  elfutils::cu_iterator prev_cit = elfutils::cu_iterator::end ();
-  elfutils::cu_iterator last_cit = elfutils::cu_iterator::end ();
-  if (opt_show_progress)
-    for (elfutils::cu_iterator it = elfutils::cu_iterator (dw);
-	 it != elfutils::cu_iterator::end (); ++it)
-      last_cit = it;
-
-  for (elfutils::all_dies_iterator it (dw);
-       it != elfutils::all_dies_iterator::end (); ++it)
-    {
-      std::bitset <count_die_types> die_type;
-      Dwarf_Die *die = *it;
-
-      if (opt_show_progress)
-	{
-	  elfutils::cu_iterator cit = it.cu ();
-	  if (cit != prev_cit)
+  // Ancestors of the last dumped DIE, CU DIE first, and the DIE
+  // itself.
+  std::vector <Dwarf_Off> m_chain;
+
+  static size_t const flush_size = 1 << 20;
+
+  void
+  line (size_t depth, Dwarf_Die *die)
+  {
+    char buf[32];
+    snprintf (buf, sizeof buf, "DIE %llx ",
+	      (unsigned long long) dwarf_dieoffset (die));
+    m_buf.append (depth + 1, ' ');
+    m_buf += buf;
+    m_buf += dwarf_tag_string (dwarf_tag (die));
+  }
+
+public:
+  explicit dump_sink (int fd)
+    : m_fd (fd)
+  {
+    m_buf.reserve (flush_size + 4096);
+  }
+
+  ~dump_sink ()
+  {
+    flush ();
+  }
+
+  void
+  dump (die_info const &info)
+  {
+    elfutils::all_dies_iterator const &it = info.it;
+    size_t depth = it.depth ();
+
+    // Skip the ancestors shared with the previous DIE.
+    size_t same = 0;
+    for (; same < depth && same < m_chain.size (); ++same)
+      {
+	Dwarf_Die die;
+	it.ancestor (depth - same, die);
+	if (dwarf_dieoffset (&die) != m_chain[same])
+	  break;
+      }
+    m_chain.resize (same);
+
+    for (size_t d = same; d < depth; ++d)
+      {
+	Dwarf_Die die;
+	it.ancestor (depth - d, die);
+	line (d, &die);
+	m_buf += '\n';
+	m_chain.push_back (dwarf_dieoffset (&die));
+      }
+
+    line (depth, info.die);
+    m_buf += ':';
+#define TYPE(T)					\
+    if (info.die_type.test (dt_##T))		\
+      m_buf += " "#T;
+    DIE_TYPES
+#undef TYPE
+    m_buf += '\n';
+    m_chain.push_back (dwarf_dieoffset (info.die));
+
+    if (m_buf.size () >= flush_size)
+      flush ();
+  }
+
+  void
+  flush ()
+  {
+    // Write errors are ignored, like those of std::cerr.
+    for (size_t done = 0; done < m_buf.size (); )
+      {
+	ssize_t w = write (m_fd, m_buf.data () + done,
+			   m_buf.size () - done);
+	if (w < 0 && errno == EINTR)
+	  continue;
+	if (w <= 0)
+	  break;
+	done += w;
+      }
+    m_buf.clear ();
+  }
+};
+
+// Base of visitors used by the command line tool.  Shows DIEs
+// selected by --dump, reports errors, and leaves the rest to RECORD.
+class cli_visitor
+  : public locstat_visitor
+{
+  die_type_matcher const &m_dump;
+  dump_sink m_sink;
+
+protected:
+  virtual void record (die_info const &info) = 0;
+
+public:
+  explicit cli_visitor (die_type_matcher const &dump)
+    : m_dump (dump)
+    , m_sink (dump.any () ? dump_fd () : -1)
+  {}
+
+  void
+  die (die_info const &info)
+  {
+    if ((m_dump & info.die_type).any ())
+      m_sink.dump (info);
+
+    record (info);
+  }
+
+  void
+  error (Dwarf_Die *die, locstat_error const &err)
+  {
+    if (opt_verbose)
+      {
+	// Keep the error in order with the dumped DIEs.
+	m_sink.flush ();
+	std::cerr << "error: " << pri::ref (die)
+		  << ": " << err << ". (skipping)" << std::endl;
+      }
+  }
+
+  // Write out whatever is left of --dump output.
+  void
+  finish ()
+  {
+    m_sink.flush ();
+  }
+};
+
+// Unless --verbose, where the errors were reported as they came,
+// summarize DIEs that couldn't be analyzed, one line per kind of
+// error.
+void
+print_errors (locstat_result const &result, std::string const &prefix = "")
+{
+  if (opt_verbose)
+    return;
+
+  for (std::vector <locstat_error_kind>::const_iterator it
+	 = result.error_kinds.begin (); it != result.error_kinds.end (); ++it)
+    {
+      std::cerr << "error: " << prefix << std::dec << it->count
+		<< (it->count == 1 ? " DIE" : " DIEs") << " skipped: "
+		<< it->error << " (";
+      if (it->count > it->examples.size ())
+	std::cerr << "e.g. ";
+      for (size_t i = 0; i < it->examples.size (); ++i)
+	std::cerr << (i > 0 ? ", " : "") << pri::ref (it->examples[i]);
+      std::cerr << ")" << std::endl;
+    }
+}
+
+// Parse ARG, a comma-separated list of hexadecimal address ranges
+// LO-HI, where HI is exclusive, or single addresses, and add them to
+// RET.  Returns false if ARG is invalid.
+bool
+parse_pc_ranges (char const *arg, ranges_t &ret)
+{
+  std::stringstream ss (arg);
+  for (std::string item; std::getline (ss, item, ','); )
+    {
+      char const *str = item.c_str ();
+      char *end;
+      Dwarf_Addr low = std::strtoull (str, &end, 16);
+      Dwarf_Addr high = low + 1;
+      if (end == str)
+	return false;
+      if (*end == '-')
+	{
+	  str = end + 1;
+	  high = std::strtoull (str, &end, 16);
+	  if (end == str)
+	    return false;
+	}
+      if (*end != '\0' || low >= high)
+	return false;
+      ret.push_back (std::make_pair (low, high));
+    }
+  return ! ret.empty ();
+}
+
+// Options for the analysis as given on the command line.
+locstat_options
+cli_options (die_type_matcher const &ignore, die_type_matcher const &dump)
+{
+  locstat_options opts;
+  opts.ignore = ignore;
+  opts.classify = dump;
+  opts.ignore_implicit_pointer = opt_ignore_implicit_pointer;
+
+  std::stringstream ss (opt_function);
+  for (std::string name; std::getline (ss, name, ','); )
+    if (! name.empty ())
+      opts.functions.insert (name);
+
+  opts.pc_ranges = opt_pc_ranges;
+  return opts;
+}
+
+// When to stop analyzing, as given by --deadline.
+std::chrono::steady_clock::time_point
+cli_deadline ()
+{
+  if (opt_deadline < 0)
+    return std::chrono::steady_clock::time_point::max ();
+  return start_time
+    + std::chrono::duration_cast <std::chrono::steady_clock::duration>
+	(std::chrono::duration <double> (opt_deadline));
+}
+
+// Open FNAME in DWFL.  If FNAME is "-", the file is read from
+// standard input, so that it can come from a pipe.
+Dwarf *
+open_input (dwfl &dwfl, char const *fname)
+{
+  if (std::strcmp (fname, "-") == 0)
+    return dwfl.open_dwarf ("<stdin>", STDIN_FILENO);
+  return dwfl.open_dwarf (fname);
+}
+
+// Results are saved by --checkpoint and --save as lines of
+// tab-separated fields.  These write and read the lines that describe
+// a locstat_result.
+void
+write_result (std::ostream &os, locstat_result const &result)
+{
+  os << "cus\t" << result.cus << ' ' << result.bytes << ' '
+     << result.cus_total << ' ' << result.bytes_total << '\n';
+
+  for (int i = cov_00; i <= 100; ++i)
+    if (unsigned long count = result.tally.at (i))
+      os << "tally\t" << i << ' ' << count << '\n';
+
+  for (std::vector <locstat_error_kind>::const_iterator it
+	 = result.error_kinds.begin (); it != result.error_kinds.end (); ++it)
+    {
+      os << "error\t" << it->count << '\t' << it->error.attr << '\t'
+	 << it->error.what << '\t'
+	 << (it->error.detail != NULL ? it->error.detail : "") << '\t'
+	 << std::hex;
+      for (size_t i = 0; i < it->examples.size (); ++i)
+	os << (i > 0 ? " " : "") << it->examples[i];
+      os << std::dec << '\n';
+    }
+}
+
+// The locstat_error strings are static, so restored ones have to live
+// until the end of the program.
+char const *
+static_string (std::string const &str)
+{
+  static std::set <std::string> strings;
+  if (str.empty ())
+    return NULL;
+  return strings.insert (str).first->c_str ();
+}
+
+// Add a line written by write_result to RESULT.  WHAT is the first
+// field, SS the rest of the line.  Returns false if the line is of
+// another kind.
+bool
+read_result (std::string const &what, std::istream &ss,
+	     locstat_result &result)
+{
+  if (what == "cus")
+    ss >> result.cus >> result.bytes >> result.cus_total
+       >> result.bytes_total;
+  else if (what == "tally")
+    {
+      int coverage;
+      unsigned long count;
+      if (ss >> coverage >> count && coverage >= cov_00 && coverage <= 100)
+	result.tally.add (coverage, count);
+    }
+  else if (what == "error")
+    {
+      std::string count, attr, err_what, detail, examples;
+      std::getline (ss, count, '\t');
+      std::getline (ss, attr, '\t');
+      std::getline (ss, err_what, '\t');
+      std::getline (ss, detail, '\t');
+      std::getline (ss, examples);
+
+      locstat_error_kind kind;
+      kind.error = locstat_error (static_string (err_what),
+				  std::strtoul (attr.c_str (), NULL, 10),
+				  static_string (detail));
+      kind.count = std::strtoul (count.c_str (), NULL, 10);
+      std::istringstream es (examples);
+      for (Dwarf_Off off; es >> std::hex >> off; )
+	kind.examples.push_back (off);
+      result.errors += kind.count;
+      result.error_kinds.push_back (kind);
+    }
+  else
+    return false;
+  return true;
+}
+
+// The options that affect the result, so that saved results are only
+// combined with compatible ones.
+std::string
+options_key ()
+{
+  std::ostringstream key;
+  key << opt_ignore << '\t' << opt_ignore_implicit_pointer;
+  if (! opt_function.empty ())
+    key << '\t' << opt_function;
+  if (! opt_pc_range.empty ())
+    key << "\tpc " << opt_pc_range;
+  return key.str ();
+}
+
+// Write LINES to PATH atomically: to a temporary file first, which is
+// then renamed over PATH.
+void
+replace_file (std::string const &path, std::string const &lines)
+{
+  std::string tmp = path + ".tmp";
+  std::ofstream ofs (tmp.c_str (), std::ios::trunc);
+  ofs << lines;
+  ofs.close ();
+  if (! ofs || rename (tmp.c_str (), path.c_str ()) != 0)
+    throw std::runtime_error ("Couldn't write `" + path + "': "
+			      + strerror (errno));
+}
+
+// What the analysis of DW is of, so that results for another file,
+// or another version of it, are not mixed in.  That is the GNU build
+// ID if the file has one, and a checksum of its debug info if not.
+// Unlike the file's name or modification time, either is the same
+// for every copy of the file, wherever it was made.
+std::string
+file_identity (Dwarf *dw)
+{
+  Elf *elf = dwarf_getelf (dw);
+  std::ostringstream ret;
+  ret << std::hex << std::setfill ('0');
+
+  void const *build_id;
+  ssize_t len = elf != NULL ? dwelf_elf_gnu_build_id (elf, &build_id) : -1;
+  if (len > 0)
+    {
+      ret << "build-id ";
+      for (ssize_t i = 0; i < len; ++i)
+	ret << std::setw (2)
+	    << (unsigned) static_cast <unsigned char const *> (build_id)[i];
+      return ret.str ();
+    }
+
+  // FNV-1a over the DIEs and their abbreviations.
+  uint64_t hash = 14695981039346656037ULL;
+  uint64_t size = 0;
+  size_t shstrndx;
+  if (elf != NULL && elf_getshdrstrndx (elf, &shstrndx) == 0)
+    for (Elf_Scn *scn = NULL; (scn = elf_nextscn (elf, scn)) != NULL; )
+      {
+	GElf_Shdr shdr;
+	char const *name;
+	Elf_Data *data;
+	if (gelf_getshdr (scn, &shdr) == NULL
+	    || (name = elf_strptr (elf, shstrndx, shdr.sh_name)) == NULL
+	    || (std::strcmp (name, ".debug_info") != 0
+		&& std::strcmp (name, ".debug_abbrev") != 0)
+	    || (data = elf_getdata (scn, NULL)) == NULL
+	    || data->d_buf == NULL)
+	  continue;
+
+	unsigned char const *buf
+	  = static_cast <unsigned char const *> (data->d_buf);
+	for (size_t i = 0; i < data->d_size; ++i)
+	  hash = (hash ^ buf[i]) * 1099511628211ULL;
+	size += data->d_size;
+      }
+
+  size_t cus = 0;
+  for (Dwarf_Off off = 0, next;
+       dwarf_nextcu (dw, off, &next, NULL, NULL, NULL, NULL) == 0;
+       off = next)
+    ++cus;
+
+  ret << "debug-info " << std::setw (16) << hash
+      << std::dec << ' ' << size << ' ' << cus;
+  return ret.str ();
+}
+
+// Snapshot of the analysis of one file for --checkpoint and
+// --resume: which CUs are done, and the result of analyzing them.  A
+// resumed run skips those CUs and merges the rest into the saved
+// result, which gives the same result as an uninterrupted run.
+class checkpoint
+{
+  // Write at most this often.
+  static std::chrono::seconds
+  interval ()
+  {
+    return std::chrono::seconds (60);
+  }
+
+  std::string m_path;
+
+  // What the checkpoint is for: the file and options that affect the
+  // result.  A checkpoint with another key is not used.
+  std::string m_key;
+
+  // Result restored from the checkpoint, and the CUs it covers.
+  locstat_result m_base;
+  std::vector <Dwarf_Off> m_cus;
+
+  std::chrono::steady_clock::time_point m_next_write;
+
+public:
+  checkpoint (std::string const &path, Dwarf *dw)
+    : m_path (path)
+    , m_next_write (std::chrono::steady_clock::now () + interval ())
+  {
+    std::ostringstream key;
+    key << file_identity (dw) << '\t' << options_key ()
+	<< '\t' << opt_shard << '/' << opt_shards;
+    m_key = key.str ();
+  }
+
+  // Restore the checkpoint, if there is one for this file and
+  // options, and add its CUs to DONE.
+  void
+  load (std::set <Dwarf_Off> &done)
+  {
+    std::ifstream ifs (m_path.c_str ());
+    if (! ifs)
+      return;
+
+    locstat_result base;
+    std::vector <Dwarf_Off> cus;
+    bool complete = false;
+    std::string line;
+    if (! std::getline (ifs, line) || line != "dwlocstat checkpoint 1"
+	|| ! std::getline (ifs, line) || line != "key\t" + m_key)
+      {
+	std::cerr << "warning: checkpoint `" << m_path << "' is for another"
+		  << " file or options, starting over." << std::endl;
+	return;
+      }
+
+    while (std::getline (ifs, line))
+      {
+	std::istringstream ss (line);
+	std::string what;
+	std::getline (ss, what, '\t');
+	if (read_result (what, ss, base))
+	  continue;
+	if (what == "cu")
+	  {
+	    Dwarf_Off off;
+	    if (ss >> std::hex >> off)
+	      cus.push_back (off);
+	  }
+	else if (what == "end")
+	  complete = true;
+      }
+
+    if (! complete)
+      {
+	std::cerr << "warning: checkpoint `" << m_path << "' is truncated,"
+		  << " starting over." << std::endl;
+	return;
+      }
+
+    m_base = base;
+    m_cus = cus;
+    done.insert (cus.begin (), cus.end ());
+  }
+
+  // Add the restored result to RESULT, which covers the rest of the
+  // CUs.
+  locstat_result
+  merge (locstat_result const &result) const
+  {
+    locstat_result ret = m_base;
+    ret.merge (result);
+    return ret;
+  }
+
+  void
+  write (locstat_result const &result) const
+  {
+    std::ostringstream os;
+    os << "dwlocstat checkpoint 1\n"
+       << "key\t" << m_key << '\n';
+    write_result (os, merge (result));
+    os << std::hex;
+    for (std::vector <Dwarf_Off>::const_iterator it = m_cus.begin ();
+	 it != m_cus.end (); ++it)
+      os << "cu\t" << *it << '\n';
+    os << "end\n";
+    replace_file (m_path, os.str ());
+  }
+
+  // Note that CU_OFF is done, and write a checkpoint if it's time.
+  // RESULT covers the CUs that were not restored.
+  void
+  cu_done (Dwarf_Off cu_off, locstat_result const &result)
+  {
+    m_cus.push_back (cu_off);
+    std::chrono::steady_clock::time_point now
+      = std::chrono::steady_clock::now ();
+    if (now >= m_next_write)
+      {
+	write (result);
+	m_next_write = now + interval ();
+      }
+  }
+
+  // The analysis is complete, the checkpoint is no longer needed.
+  void
+  remove () const
+  {
+    std::remove (m_path.c_str ());
+  }
+};
+
+class process_visitor
+  : public cli_visitor
+{
+  groups_t &m_groups;
+  pc_map &m_pc_map;
+  checkpoint *m_checkpoint;
+
+protected:
+  void
+  record (die_info const &info)
+  {
+    if (! m_groups.empty ())
+      m_groups.add (info.it, info.die, info.die_type, info.coverage);
+    if (m_pc_map.enabled ())
+      m_pc_map.add (info);
+  }
+
+public:
+  process_visitor (die_type_matcher const &dump,
+		   groups_t &groups, pc_map &pc_map,
+		   checkpoint *checkpoint)
+    : cli_visitor (dump)
+    , m_groups (groups)
+    , m_pc_map (pc_map)
+    , m_checkpoint (checkpoint)
+  {}
+
+  void
+  cu_done (Dwarf_Off cu_off, locstat_result const &result)
+  {
+    if (m_checkpoint != NULL)
+      m_checkpoint->cu_done (cu_off, result);
+  }
+};
+
+// Say how much of the file RESULT covers, if not all of it.
+void
+print_partial (locstat_result const &result)
+{
+  if (! result.partial ())
+    return;
+
+  std::cout << "partial result"
+	    << (result.expired ? " (deadline reached)" : "") << ": "
+	    << result.cus << '/' << result.cus_total << " CUs, "
+	    << result.bytes << '/' << result.bytes_total
+	    << " bytes of .debug_info ("
+	    << (result.bytes_total > 0
+		? 100 * result.bytes / result.bytes_total : 0)
+	    << "%)" << std::endl;
+}
+
+// Print the error summary and the histogram of RESULT.  Returns
+// false if there's nothing to show.
+bool
+print_result (locstat_result const &result, tabrules_t const &tabrules)
+{
+  print_errors (result);
+  print_partial (result);
+
+  histogram const &tally = result.tally;
+
+  unsigned long total = tally.total ();
+  if (total == 0)
+    {
+      std::cout << "No coverage recorded." << std::endl;
+      return false;
+    }
+
+  std::cout << "cov%\tsamples\tcumul" << std::endl;
+  std::vector <bucket> buckets = tabulate (tally, tabrules);
+  for (std::vector <bucket>::const_iterator it = buckets.begin ();
+       it != buckets.end (); ++it)
+    std::cout << *it << "\t" << it->samples
+	      << '/' << (100*it->samples / total) << '%'
+	      << "\t" << it->cumulative
+	      << '/' << (100*it->cumulative / total) << '%'
+	      << std::endl;
+  return true;
+}
+
+// Save RESULT of analyzing DW to PATH for --merge.
+void
+save_result (std::string const &path, Dwarf *dw,
+	     locstat_result const &result)
+{
+  std::ostringstream os;
+  os << "dwlocstat result 1\n"
+     << "key\t" << file_identity (dw) << '\t' << options_key () << '\n'
+     << "shard\t" << opt_shard << ' ' << opt_shards << '\n';
+  write_result (os, result);
+  os << "end\n";
+  replace_file (path, os.str ());
+}
+
+// Combine results saved by --save, e.g. those of all shards of a
+// file, and print them.
+int
+merge (char const *const *fnames, size_t count)
+{
+  locstat_result result;
+  std::string key;
+  std::set <std::pair <unsigned, unsigned> > shards;
+  for (size_t i = 0; i < count; ++i)
+    {
+      std::ifstream ifs (fnames[i]);
+      std::string line;
+      if (! std::getline (ifs, line) || line != "dwlocstat result 1")
+	{
+	  std::cerr << "error: `" << fnames[i]
+		    << "' is not a saved result." << std::endl;
+	  return 1;
+	}
+
+      locstat_result part;
+      bool complete = false;
+      while (std::getline (ifs, line))
+	{
+	  std::istringstream ss (line);
+	  std::string what;
+	  std::getline (ss, what, '\t');
+	  if (read_result (what, ss, part))
+	    continue;
+	  if (what == "key")
+	    {
+	      std::string rest = line.substr (4);
+	      if (i > 0 && rest != key)
+		{
+		  std::cerr << "error: `" << fnames[i] << "' was made for"
+			    << " a different file, or with different options."
+			    << std::endl;
+		  return 1;
+		}
+	      key = rest;
+	    }
+	  else if (what == "shard")
+	    {
+	      std::pair <unsigned, unsigned> shard;
+	      ss >> shard.first >> shard.second;
+	      if (! shards.empty ()
+		  && shards.begin ()->second != shard.second)
+		{
+		  std::cerr << "error: `" << fnames[i] << "' was made with "
+			    << shard.second << " shards, not "
+			    << shards.begin ()->second << '.' << std::endl;
+		  return 1;
+		}
+	      if (! shards.insert (shard).second)
+		{
+		  std::cerr << "error: `" << fnames[i] << "': shard "
+			    << shard.first << '/' << shard.second
+			    << " was already merged." << std::endl;
+		  return 1;
+		}
+	    }
+	  else if (what == "end")
+	    complete = true;
+	}
+
+      if (! complete)
+	{
+	  std::cerr << "error: `" << fnames[i] << "' is truncated."
+		    << std::endl;
+	  return 1;
+	}
+      result.merge (part);
+    }
+
+  print_result (result, tabrules_t (opt_tabulate));
+  return 0;
+}
+
+// Analysis by --procs worker processes, forked after the file is
+// opened.  Workers take CUs one at a time from a counter in a shared
+// mapping.  Each worker keeps its tally in a slot of its own in the
+// same mapping, and at the end adds the rest of its result there in
+// the --save format.  The parent then merges the slots.
+class forked_analysis
+{
+  // Room for the error summary of one worker.
+  static size_t const text_size = 64 * 1024;
+
+  struct shared
+  {
+    // Index of the next CU to analyze, in the order in which the
+    // analysis visits them.
+    alignas (64) std::atomic <size_t> next_cu;
+  };
+
+  // Slots are padded to cache lines, so that workers don't contend.
+  struct alignas (64) slot
+  {
+    unsigned long tally[102];
+    char text[text_size];
+  };
+
+  class worker_visitor
+    : public cli_visitor
+  {
+    std::atomic <size_t> &m_next_cu;
+    slot &m_slot;
+    size_t m_seen;
+    size_t m_claimed;
+
+  protected:
+    void
+    record (die_info const &info)
+    {}
+
+  public:
+    worker_visitor (die_type_matcher const &dump,
+		    std::atomic <size_t> &next_cu, slot &a_slot)
+      : cli_visitor (dump)
+      , m_next_cu (next_cu)
+      , m_slot (a_slot)
+      , m_seen (0)
+      , m_claimed (-1)
+    {}
+
+    // Only claim a CU when the previous one is done, so that no
+    // worker sits on CUs that others could take.
+    bool
+    want_cu (Dwarf_Off cu_off)
+    {
+      if (m_claimed == (size_t)-1)
+	m_claimed = m_next_cu++;
+      if (m_seen++ != m_claimed)
+	return false;
+      m_claimed = -1;
+      return true;
+    }
+
+    void
+    cu_done (Dwarf_Off cu_off, locstat_result const &result)
+    {
+      for (int i = cov_00; i <= 100; ++i)
+	m_slot.tally[i - cov_00] = result.tally.at (i);
+    }
+  };
+
+  size_t m_size;
+  void *m_mem;
+  std::vector <slot *> m_slots;
+
+  shared &
+  header ()
+  {
+    return *static_cast <shared *> (m_mem);
+  }
+
+  // Analyze DW in a worker, and exit.
+  void
+  work (Dwarf *dw, locstat_options const &opts,
+	die_type_matcher const &dump, slot &out)
+  {
+    int status = 0;
+    try
+      {
+	worker_visitor visitor (dump, header ().next_cu, out);
+	locstat_result result = locstat_analyze (dw, opts, &visitor);
+	visitor.finish ();
+
+	// The tally is in the slot already, save the rest.
+	result.tally = histogram ();
+	std::ostringstream os;
+	write_result (os, result);
+	os << (result.expired ? "expired\n" : "") << "end\n";
+
+	// Cut an oversized summary at a line boundary.  The kinds of
+	// errors that don't fit are not shown.
+	std::string text = os.str ();
+	if (text.size () >= text_size)
+	  {
+	    text.resize (text.rfind ('\n', text_size - 6) + 1);
+	    text += "end\n";
+	  }
+	std::strcpy (out.text, text.c_str ());
+      }
+    // Whatever happens, the child mustn't return into the parent's
+    // code.
+    catch (std::exception const &e)
+      {
+	std::cerr << "error: " << e.what () << std::endl;
+	status = 1;
+      }
+    catch (...)
+      {
+	std::cerr << "error: unknown exception in worker process."
+		  << std::endl;
+	status = 1;
+      }
+
+    std::cerr.flush ();
+    _exit (status);
+  }
+
+public:
+  explicit forked_analysis (unsigned procs)
+    : m_size (sizeof (shared) + procs * sizeof (slot))
+    , m_mem (mmap (NULL, m_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0))
+  {
+    if (m_mem == MAP_FAILED)
+      throw std::runtime_error (std::string ("mmap: ") + strerror (errno));
+
+    new (m_mem) shared ();
+    header ().next_cu = 0;
+    slot *slots = reinterpret_cast <slot *> (static_cast <char *> (m_mem)
+					     + sizeof (shared));
+    for (unsigned i = 0; i < procs; ++i)
+      m_slots.push_back (slots + i);
+  }
+
+  ~forked_analysis ()
+  {
+    munmap (m_mem, m_size);
+  }
+
+  locstat_result
+  run (Dwarf *dw, locstat_options const &opts,
+       die_type_matcher const &dump)
+  {
+    // Don't let the workers inherit unwritten output.
+    std::cout.flush ();
+    std::cerr.flush ();
+
+    std::vector <pid_t> pids;
+    for (size_t i = 0; i < m_slots.size (); ++i)
+      {
+	pid_t pid = fork ();
+	if (pid == 0)
+	  work (dw, opts, dump, *m_slots[i]);
+	if (pid < 0)
+	  {
+	    // Let those that were started finish.
+	    std::cerr << "error: fork: " << strerror (errno) << std::endl;
+	    break;
+	  }
+	pids.push_back (pid);
+      }
+
+    bool failed = pids.empty ();
+    for (size_t i = 0; i < pids.size (); ++i)
+      {
+	int status;
+	if (waitpid (pids[i], &status, 0) < 0
+	    || ! WIFEXITED (status) || WEXITSTATUS (status) != 0)
+	  failed = true;
+      }
+    if (failed)
+      throw std::runtime_error ("Analysis in worker process failed");
+
+    locstat_result result;
+    for (size_t i = 0; i < pids.size (); ++i)
+      {
+	locstat_result part;
+	for (int c = cov_00; c <= 100; ++c)
+	  if (unsigned long count = m_slots[i]->tally[c - cov_00])
+	    part.tally.add (c, count);
+
+	std::istringstream is (m_slots[i]->text);
+	for (std::string line; std::getline (is, line); )
+	  {
+	    std::istringstream ss (line);
+	    std::string what;
+	    std::getline (ss, what, '\t');
+	    if (! read_result (what, ss, part) && what == "expired")
+	      part.expired = true;
+	  }
+	result.merge (part);
+      }
+
+    return result;
+  }
+};
+
+// Analyze DW and print the results.  Returns false if the deadline
+// cut the analysis short.
+bool
+process (Dwarf *dw, std::vector <Dwarf *> const &workers,
+	 die_type_matcher const &ignore, die_type_matcher const &dump)
+{
+  tabrules_t tabrules (opt_tabulate);
+  groups_t groups (opt_group_by);
+  pc_map pc_map (opt_pc_map, opt_pc_map_functions);
+  progress_meter progress (dw, opt_show_progress);
+
+  locstat_options opts = cli_options (ignore, dump);
+  opts.want_covered = pc_map.enabled ();
+  opts.progress = &progress;
+  opts.workers = workers;
+  opts.deadline = cli_deadline ();
+  opts.shard = opt_shard - 1;
+  opts.shards = opt_shards;
+  // Grouping by class needs to know about the classes.  Mutability
+  // is left out unless --ignore or --dump asks for it anyway:
+  // DIEs whose mutability can't be determined are dropped, and
+  // grouping shouldn't change what is counted.
+  if (groups.has (gk_class))
+    {
+      std::bitset <count_die_types> classes;
+      classes.set ();
+      classes.reset (dt_mutable);
+      classes.reset (dt_immutable);
+      opts.classify |= classes;
+    }
+
+  std::unique_ptr <checkpoint> ckpt;
+  if (! opt_checkpoint.empty ())
+    {
+      ckpt.reset (new checkpoint (opt_checkpoint, dw));
+      if (opt_resume)
+	ckpt->load (opts.skip_cus);
+    }
+
+  process_visitor visitor (dump, groups, pc_map, ckpt.get ());
+  locstat_result result;
+  if (opt_procs > 0)
+    {
+      // The workers' progress would be drawn over each other.
+      opts.progress = NULL;
+      result = forked_analysis (opt_procs).run (dw, opts, dump);
+    }
+  else
+    result = locstat_analyze (dw, opts, &visitor);
+  visitor.finish ();
+  progress.finish ();
+
+  if (ckpt != NULL)
+    {
+      if (result.expired)
+	ckpt->write (result);
+      else
+	ckpt->remove ();
+      result = ckpt->merge (result);
+    }
+
+  if (! opt_save.empty ())
+    save_result (opt_save, dw, result);
+
+  if (! print_result (result, tabrules))
+    return ! result.expired;
+
+  if (! groups.empty ())
+    groups.print (tabrules, opt_worst);
+
+  if (pc_map.enabled ())
+    pc_map.print ();
+
+  return ! result.expired;
+}
+
+// An ELF member of an archive, and what came of its analysis.
+struct archive_member
+{
+  std::string name;
+  std::vector <char> image;
+  locstat_result result;
+
+  // Why the member couldn't be analyzed, if it couldn't.
+  std::string failure;
+
+  // Errors reported by --verbose.  They are kept, so that they can
+  // be shown in order with the member's results.
+  std::string log;
+};
+
+class member_visitor
+  : public locstat_visitor
+{
+  std::ostream &m_log;
+
+public:
+  explicit member_visitor (std::ostream &log)
+    : m_log (log)
+  {}
+
+  void
+  die (die_info const &info)
+  {}
+
+  void
+  error (Dwarf_Die *die, locstat_error const &err)
+  {
+    if (opt_verbose)
+      m_log << "error: " << pri::ref (die)
+	    << ": " << err << ". (skipping)" << std::endl;
+  }
+};
+
+// Analyze MEMBER in DWFL.  Nothing is printed, so this can run on
+// any thread.
+void
+analyze_member (dwfl &dwfl, archive_member &member,
+		locstat_options const &opts)
+{
+  std::ostringstream log;
+  member_visitor visitor (log);
+  try
+    {
+      Dwarf *dw = dwfl.open_dwarf (member.name.c_str (), member.image);
+      member.result = locstat_analyze (dw, opts, &visitor);
+    }
+  catch (std::runtime_error const &e)
+    {
+      member.failure = e.what ();
+    }
+  member.log = log.str ();
+}
+
+// Threads that analyze archive members, each with a Dwfl session of
+// its own.  Without threads, members are analyzed as they are added.
+class member_pool
+{
+  locstat_options const &m_opts;
+  bounded_queue <archive_member *> m_work;
+  bounded_queue <archive_member *> m_done;
+  std::vector <std::thread> m_threads;
+  std::set <archive_member *> m_finished;
+  dwfl m_dwfl;
+
+  void
+  work ()
+  {
+    dwfl dwfl;
+    while (archive_member *member = m_work.pop ())
+      {
+	analyze_member (dwfl, *member, m_opts);
+	m_done.push (member);
+      }
+  }
+
+public:
+  // At most SIZE members, a power of two, may be added and not
+  // waited for yet.
+  member_pool (locstat_options const &opts, unsigned threads, size_t size)
+    : m_opts (opts)
+    , m_work (size)
+    , m_done (size)
+  {
+    for (unsigned i = 0; i < threads; ++i)
+      m_threads.push_back (std::thread (&member_pool::work, this));
+  }
+
+  void
+  add (archive_member *member)
+  {
+    if (! m_threads.empty ())
+      m_work.push (member);
+    else
+      {
+	analyze_member (m_dwfl, *member, m_opts);
+	m_finished.insert (member);
+      }
+  }
+
+  // Wait until MEMBER is analyzed.
+  void
+  wait (archive_member *member)
+  {
+    while (m_finished.erase (member) == 0)
+      m_finished.insert (m_done.pop ());
+  }
+
+  ~member_pool ()
+  {
+    for (size_t i = 0; i < m_threads.size (); ++i)
+      m_work.push (NULL);
+    for (size_t i = 0; i < m_threads.size (); ++i)
+      m_threads[i].join ();
+  }
+};
+
+// Add RESULT, that of analyzing one file, to TOTAL, that of several
+// files.  Unlike with locstat_result::merge, the totals add up.
+void
+add_file_result (locstat_result &total, locstat_result const &result)
+{
+  unsigned long cus_total = total.cus_total + result.cus_total;
+  uint64_t bytes_total = total.bytes_total + result.bytes_total;
+  total.merge (result);
+  total.cus_total = cus_total;
+  total.bytes_total = bytes_total;
+}
+
+// Analyze each ELF member of AR, which was opened from FNAME, and
+// print the results for each, and then for all of them together.
+// With --jobs, that many members are analyzed at a time, which pays
+// off better than pipelining the analysis of the typically small
+// members.  Returns false if the deadline cut the analysis short.
+bool
+process_archive (std::string const &fname, archive &ar,
+		 die_type_matcher const &ignore, die_type_matcher const &dump)
+{
+  // Only the tally and errors are kept for each member.
+  if (! opt_group_by.empty () || opt_pc_map || dump.any ()
+      || ! opt_checkpoint.empty () || ! opt_save.empty ()
+      || opt_shards > 1 || opt_procs > 0)
+    throw std::runtime_error ("--group-by, --pc-map, --dump, --checkpoint, "
+			      "--save, --shard and --procs can't be used "
+			      "with archives");
+
+  tabrules_t tabrules (opt_tabulate);
+  locstat_options opts = cli_options (ignore, dump);
+  opts.deadline = cli_deadline ();
+
+  // Members are read ahead while the one whose results are to be
+  // printed next is being analyzed, but not too far, as each is held
+  // in memory.
+  size_t ahead = 2;
+  while (ahead < 2 * opt_jobs)
+    ahead *= 2;
+
+  locstat_result total;
+  unsigned long count = 0, failed = 0;
+  std::deque <std::unique_ptr <archive_member> > pending;
+  member_pool pool (opts, opt_jobs, ahead);
+
+  for (bool more = true; more || ! pending.empty (); )
+    {
+      if (more && pending.size () < ahead)
+	{
+	  // Members that weren't taken up by the deadline are left
+	  // out.
+	  if (std::chrono::steady_clock::now () >= opts.deadline)
+	    {
+	      total.expired = true;
+	      more = false;
+	      continue;
+	    }
+
+	  std::unique_ptr <archive_member> member (new archive_member);
+	  more = ar.next (member->name, member->image);
+	  if (more)
 	    {
-	      prev_cit = cit;
-	      std::cout << pri::ref (*cit) << '/' << pri::ref (*last_cit)
-			<< '\r' << std::flush;
+	      member->name = fname + "(" + member->name + ")";
+	      count++;
+	      pool.add (member.get ());
+	      pending.push_back (std::move (member));
 	    }
+	  continue;
+	}
+
+      archive_member &member = *pending.front ();
+      pool.wait (&member);
+
+      std::cout << std::endl << member.name << ":" << std::endl;
+      std::cerr << member.log;
+      if (! member.failure.empty ())
+	{
+	  std::cerr << "error: " << member.name << ": " << member.failure
+		    << ". (skipping)" << std::endl;
+	  failed++;
 	}
+      else
+	{
+	  print_result (member.result, tabrules);
+	  add_file_result (total, member.result);
+	}
+      pending.pop_front ();
+    }
+
+  std::cout << std::endl << fname << ": " << count - failed << " of "
+	    << count << " ELF members"
+	    << (total.expired ? " (deadline reached)" : "") << ":"
+	    << std::endl;
+  print_result (total, tabrules);
+  return ! total.expired;
+}
+
+// Coverage of variables and parameters of one binary, each keyed by
+// an identity that is stable across builds: CU name, chain of
+// enclosing functions, name of the variable, and its declaration
+// line.  Identities are matched by a 64-bit hash first, and by
+// their text when the hashes agree.
+class identity_set
+{
+public:
+  struct entry
+  {
+    uint64_t hash;
+    uint32_t name;
+    int coverage;
+  };
+
+private:
+  std::vector <entry> m_entries;
+  std::string m_names;
+  histogram m_hist;
+
+  // Number of times each identity was seen, so that identical
+  // identities (e.g. a function inlined twice into the same caller)
+  // can be told apart by order of appearance.  Keyed by the text, so
+  // that a hash collision doesn't renumber an unrelated identity.
+  std::unordered_map <std::string, uint32_t> m_seen;
 
-      // We are interested in variables and formal parameters
-      bool is_formal_parameter = dwarf_tag (die) == DW_TAG_formal_parameter;
-      if (! is_formal_parameter && dwarf_tag (die) != DW_TAG_variable)
-	continue;
+  // Identity prefix for children of the last parent DIE.
+  Dwarf_Off m_parent_off;
+  std::string m_prefix;
 
-      // Ignore those that are just declarations
-      if (die_flag_value (die, DW_AT_declaration))
-	continue;
+  static uint64_t
+  hash (std::string const &str)
+  {
+    // FNV-1a.
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (std::string::const_iterator it = str.begin ();
+	 it != str.end (); ++it)
+      {
+	h ^= (unsigned char)*it;
+	h *= 0x100000001b3ULL;
+      }
+    return h;
+  }
 
-      // Possibly ignore artificial, unless configured othewise.
-      if (ignore.test (dt_artificial)
-	  && die_flag_value (die, DW_AT_artificial))
-	continue;
+  static char const *
+  name (Dwarf_Die *die)
+  {
+    Dwarf_Attribute attr_mem,
+      *attr = dwarf_attr_integrate (die, DW_AT_name, &attr_mem);
+    char const *ret = attr != NULL ? dwarf_formstring (attr) : NULL;
+    return ret != NULL ? ret : "???";
+  }
 
-      // Of formal parameters we ignore those that are children of
-      // subprograms that are themselves declarations.
-      if (is_formal_parameter)
+  static std::string
+  prefix (elfutils::all_dies_iterator const &it)
+  {
+    std::string ret;
+    std::vector <Dwarf_Die> stack = it.stack ();
+    // The last element is the DIE itself.
+    stack.pop_back ();
+    for (std::vector <Dwarf_Die>::iterator jt = stack.begin ();
+	 jt != stack.end (); ++jt)
+      switch (dwarf_tag (&*jt))
 	{
-	  Dwarf_Die *parent = *it.parent ();
-	  if (dwarf_tag (parent) == DW_TAG_subroutine_type
-	      || die_flag_value (parent, DW_AT_declaration))
-	    continue;
+	case DW_TAG_compile_unit:
+	case DW_TAG_subprogram:
+	case DW_TAG_inlined_subroutine:
+	  ret += name (&*jt);
+	  ret += '/';
 	}
+    return ret;
+  }
 
-      if (interested.test (dt_inlined)
-	  || interested.test (dt_inlined_subroutine))
-	{
-	  bool inlined = false;
-	  bool inlined_subroutine = false;
-	  std::vector <Dwarf_Die> const &stack = it.stack ();
-	  for (std::vector <Dwarf_Die>::const_iterator jt = stack.begin ();
-	       jt != stack.end (); ++jt)
-	    {
-	      Dwarf_Die die2 = *jt;
-	      if (interested.test (dt_inlined)
-		  && dwarf_tag (&die2) == DW_TAG_subprogram
-		  && is_inlined (&die2))
-		{
-		  inlined = true;
-		  if (interested.test (dt_inlined_subroutine)
-		      && inlined_subroutine)
-		    break;
-		}
-	      if (interested.test (dt_inlined_subroutine)
-		  && dwarf_tag (&die2) == DW_TAG_inlined_subroutine)
-		{
-		  inlined_subroutine = true;
-		  if (interested.test (dt_inlined)
-		      && inlined)
-		    break;
-		}
-	    }
+public:
+  identity_set ()
+    : m_parent_off ((Dwarf_Off)-1)
+  {}
 
-	  if (inlined)
-	    {
-	      if (ignore.test (dt_inlined))
-		continue;
-	      die_type.set (dt_inlined);
-	    }
-	  if (inlined_subroutine)
-	    {
-	      if (ignore.test (dt_inlined_subroutine))
-		continue;
-	      die_type.set (dt_inlined_subroutine, inlined_subroutine);
-	    }
-	}
+  void
+  add (elfutils::all_dies_iterator const &it, Dwarf_Die *die, int coverage)
+  {
+    if (it.parent_offset () != m_parent_off)
+      {
+	m_parent_off = it.parent_offset ();
+	m_prefix = prefix (it);
+      }
 
-      Dwarf_Attribute locattr_mem,
-	*locattr = dwarf_attr_integrate (die, DW_AT_location, &locattr_mem);
+    std::stringstream ss;
+    ss << m_prefix << name (die);
+    int line;
+    if (dwarf_decl_line (die, &line) == 0)
+      ss << ':' << std::dec << line;
+    std::string id = ss.str ();
+
+    uint32_t nth = m_seen[id]++;
+    if (nth > 0)
+      {
+	ss << '#' << nth;
+	id = ss.str ();
+      }
+    uint64_t h = hash (id);
 
-      // Also ignore extern globals -- these have DW_AT_external and
-      // no DW_AT_location.
-      if (die_flag_value (die, DW_AT_external) && locattr == NULL)
-	continue;
+    entry e = { h, (uint32_t)m_names.size (), coverage };
+    m_entries.push_back (e);
+    m_names.append (id.c_str (), id.size () + 1);
+    m_hist.add (coverage);
+  }
 
-      if (locattr == NULL)
-	locattr = dwarf_attr (die, DW_AT_const_value, &locattr_mem);
+  std::vector <entry> const &
+  entries () const
+  {
+    return m_entries;
+  }
 
-      /*
-      Dwarf_Attribute name_attr_mem,
-	*name_attr = dwarf_attr_integrate (die, DW_AT_name, &name_attr_mem);
-      std::string name = name_attr != NULL
-	? dwarf_formstring (name_attr)
-	: (dwarf_hasattr_integrate (die, DW_AT_artificial)
-	   ? "<artificial>" : "???");
+  char const *
+  name (entry const &e) const
+  {
+    return m_names.c_str () + e.name;
+  }
 
-      std::cerr << "die=" << std::hex << die.offset ()
-		<< " '" << name << '\'';
-      */
+  histogram const &
+  hist () const
+  {
+    return m_hist;
+  }
+};
 
-      int coverage;
-      mutability_t mut;
-      try
-	{
-	  if (process_location (locattr, find_ranges (it),
-				interested_mutability,
-				interested_implicit,
-				full_implicit,
-				die_type, mut, coverage) != da_ok)
-	    continue;
-	}
-      catch (std::runtime_error const &e)
-	{
-	  std::cerr << "error: " << pri::ref (*it)
-		    << ": " << e.what () << ". (skipping)" << std::endl;
-	  // Skip the erroneous DIE.
-	  continue;
-	}
+class identity_visitor
+  : public cli_visitor
+{
+  identity_set &m_ids;
 
-      if ((ignore & die_type).any ())
-	continue;
+protected:
+  void
+  record (die_info const &info)
+  {
+    m_ids.add (info.it, info.die, info.coverage);
+  }
 
-      if (coverage == cov_00)
-	{
-	  if (ignore.test (dt_no_coverage))
-	    continue;
-	  die_type.set (dt_no_coverage);
-	}
-      else if (interested_mutability)
-	{
-	  assert (mut.is_mutable () || mut.is_immutable ());
-	  if (mut.is_mutable ())
-	    {
-	      if (ignore.test (dt_mutable))
-		continue;
-	      die_type.set (dt_mutable);
-	    }
-	  if (mut.is_immutable ())
-	    {
-	      if (ignore.test (dt_immutable))
-		continue;
-	      die_type.set (dt_immutable);
-	    }
-	}
+public:
+  identity_visitor (die_type_matcher const &dump, identity_set &ids)
+    : cli_visitor (dump)
+    , m_ids (ids)
+  {}
+};
 
-      if ((dump & die_type).any ())
-	{
-#define TYPE(T) << (die_type.test (dt_##T) ? #T" " : "")
-	  std::cerr DIE_TYPES << "DIE:" << std::endl;
-#undef TYPE
+namespace
+{
+  void
+  collect (char const *fname,
+	   die_type_matcher const &ignore, die_type_matcher const &dump,
+	   identity_set &ids, locstat_result &result, std::string &error)
+  {
+    try
+      {
+	identity_visitor visitor (dump, ids);
+	dwfl dwfl;
+	Dwarf *dw = open_input (dwfl, fname);
+	result = locstat_analyze (dw, cli_options (ignore, dump), &visitor);
+	visitor.finish ();
+      }
+    catch (std::runtime_error const &e)
+      {
+	error = std::string (fname) + ": " + e.what ();
+      }
+  }
 
-	  std::string pad = " ";
-	  std::vector <Dwarf_Die> const &stack = it.stack ();
-	  for (std::vector <Dwarf_Die>::const_iterator jt = stack.begin ();
-	       jt != stack.end (); ++jt)
-	    {
-	      Dwarf_Die die2 = *jt;
-	      std::cerr << pad << pri::ref (&die2) << " "
-			<< dwarf_tag_string (dwarf_tag (&die2)) << std::endl;
-	      pad += " ";
-	    }
-	}
+  std::ostream &
+  print_coverage (std::ostream &os, int coverage)
+  {
+    if (coverage == cov_00)
+      return os << "0.0";
+    return os << std::dec << coverage;
+  }
+}
 
-      tally[coverage]++;
-      total++;
-      //std::cerr << std::endl;
+// Analyze OLD and NEW (concurrently), match their variables and
+// parameters by identity, and show how coverage changed.
+int
+diff (char const *old_fname, char const *new_fname,
+      die_type_matcher const &ignore, die_type_matcher const &dump)
+{
+  identity_set old_ids, new_ids;
+  locstat_result old_result, new_result;
+  std::string old_error, new_error;
+
+  // Per-DIE output of concurrent analyses would interleave, so with
+  // --dump or --verbose, OLD is analyzed first, then NEW.
+  if (dump.any () || opt_verbose)
+    {
+      collect (old_fname, ignore, dump, old_ids, old_result, old_error);
+      collect (new_fname, ignore, dump, new_ids, new_result, new_error);
+    }
+  else
+    {
+      std::thread old_thread (collect, old_fname, std::cref (ignore),
+			      std::cref (dump), std::ref (old_ids),
+			      std::ref (old_result), std::ref (old_error));
+      collect (new_fname, ignore, dump, new_ids, new_result, new_error);
+      old_thread.join ();
     }
 
-  if (opt_show_progress)
-    std::cout << std::endl;
+  print_errors (old_result, std::string (old_fname) + ": ");
+  print_errors (new_result, std::string (new_fname) + ": ");
 
-  unsigned long cumulative = 0;
-  unsigned long last = 0;
-  int last_pct = cov_00;
-  if (total == 0)
+  if (! old_error.empty () || ! new_error.empty ())
     {
-      std::cout << "No coverage recorded." << std::endl;
-      return;
+      if (! old_error.empty ())
+	std::cerr << "error: " << old_error << std::endl;
+      if (! new_error.empty ())
+	std::cerr << "error: " << new_error << std::endl;
+      return 1;
     }
 
-  std::cout << "cov%\tsamples\tcumul" << std::endl;
-  for (int i = cov_00; i <= 100; ++i)
+  // Hash join.  Build the table on OLD, probe it with NEW.
+  std::vector <identity_set::entry> const &olds = old_ids.entries ();
+  std::vector <identity_set::entry> const &news = new_ids.entries ();
+  // Hashes may collide, so the names are compared as well, and each
+  // OLD entry is matched at most once.
+  typedef std::unordered_multimap <uint64_t, uint32_t> table_t;
+  table_t table;
+  table.reserve (olds.size ());
+  for (uint32_t i = 0; i < olds.size (); ++i)
+    table.insert (std::make_pair (olds[i].hash, i));
+
+  // Pairs of (OLD index, NEW index).
+  std::vector <std::pair <uint32_t, uint32_t> > matched;
+  std::vector <bool> old_matched (olds.size (), false);
+  for (uint32_t i = 0; i < news.size (); ++i)
     {
-      cumulative += tally.find (i)->second;
-      if (tabrules.match (i))
-	{
-	  long int samples = cumulative - last;
-
-	  // The case 0.0..x should be printed simply as 0
-	  if (last_pct == cov_00 && i > cov_00)
-	    last_pct = 0;
+      std::pair <table_t::const_iterator, table_t::const_iterator>
+	range = table.equal_range (news[i].hash);
+      for (table_t::const_iterator it = range.first;
+	   it != range.second; ++it)
+	if (! old_matched[it->second]
+	    && std::strcmp (old_ids.name (olds[it->second]),
+			    new_ids.name (news[i])) == 0)
+	  {
+	    old_matched[it->second] = true;
+	    matched.push_back (std::make_pair (it->second, i));
+	    break;
+	  }
+    }
 
-	  if (last_pct == cov_00)
-	    std::cout << "0.0";
-	  else
-	    std::cout << std::dec << last_pct;
-
-	  if (last_pct != i)
-	    std::cout << ".." << i;
-	  std::cout << "\t" << samples
-		    << '/' << (100*samples / total) << '%'
-		    << "\t" << cumulative
-		    << '/' << (100*cumulative / total) << '%'
-		    << std::endl;
-	  last = cumulative;
-	  last_pct = i + 1;
+  tabrules_t tabrules (opt_tabulate);
+  std::vector <bucket> old_buckets = tabulate (old_ids.hist (), tabrules);
+  std::vector <bucket> new_buckets = tabulate (new_ids.hist (), tabrules);
+  std::cout << "cov%\told\tnew\tdelta" << std::endl;
+  for (size_t i = 0; i < old_buckets.size (); ++i)
+    std::cout << old_buckets[i] << "\t" << old_buckets[i].samples
+	      << "\t" << new_buckets[i].samples << "\t" << std::showpos
+	      << (long)new_buckets[i].samples - (long)old_buckets[i].samples
+	      << std::noshowpos << std::endl;
+
+  std::cout << std::endl
+	    << "matched: " << matched.size () << std::endl
+	    << "only in old: " << olds.size () - matched.size () << std::endl
+	    << "only in new: " << news.size () - matched.size () << std::endl;
+
+  // Sharp zero and 0% are the same for the purpose of regressions.
+  struct delta
+  {
+    static int
+    of (identity_set::entry const &o, identity_set::entry const &n)
+    {
+      return std::max (n.coverage, 0) - std::max (o.coverage, 0);
+    }
+  };
+  std::stable_sort (matched.begin (), matched.end (),
+		    [&olds, &news] (std::pair <uint32_t, uint32_t> const &a,
+				    std::pair <uint32_t, uint32_t> const &b)
+		    {
+		      return delta::of (olds[a.first], news[a.second])
+			< delta::of (olds[b.first], news[b.second]);
+		    });
 
-	  tabrules.next ();
-	}
+  size_t worst = opt_worst > 0 ? opt_worst : 10;
+  std::cout << std::endl << "delta\told%\tnew%\tvariable" << std::endl;
+  for (size_t i = 0; i < matched.size () && i < worst; ++i)
+    {
+      identity_set::entry const &o = olds[matched[i].first];
+      identity_set::entry const &n = news[matched[i].second];
+      int d = delta::of (o, n);
+      if (d >= 0)
+	break;
+      std::cout << std::dec << d << "\t";
+      print_coverage (std::cout, o.coverage) << "\t";
+      print_coverage (std::cout, n.coverage) << "\t"
+	<< new_ids.name (n) << std::endl;
     }
+
+  return 0;
 }
 
+// Batch of files to process.  Keeps one Dwfl session alive for the
+// whole run, and records outcome of each file in a status file, if
+// one was requested.  With read-ahead, files are processed a few
+// names behind the one that was added last, so that the prefetcher
+// has time to read them ahead.
+class batch
+{
+  die_type_matcher const &m_ignore;
+  die_type_matcher const &m_dump;
+  dwfl m_dwfl;
+  std::set <std::string> m_done;
+  std::ofstream m_status;
+  bool m_verbose;
+  unsigned m_failed;
+  std::unique_ptr <prefetcher> m_prefetcher;
+  std::deque <std::string> m_queue;
+
+  // How many files are added before the first one is processed.
+  static size_t const lookahead = 32;
+
+  void
+  record (char const *status, std::string const &fname,
+	  std::string const &msg = "")
+  {
+    if (! m_status.is_open ())
+      return;
+
+    m_status << status << '\t' << fname;
+    if (! msg.empty ())
+      m_status << '\t' << msg;
+    // Flush after each record, so that the file is usable for
+    // resuming even if we get killed.
+    m_status << std::endl;
+  }
+
+public:
+  batch (die_type_matcher const &ignore, die_type_matcher const &dump,
+	 std::string const &status, bool verbose, uint64_t prefetch)
+    : m_ignore (ignore)
+    , m_dump (dump)
+    , m_verbose (verbose)
+    , m_failed (0)
+  {
+    if (prefetch > 0)
+      m_prefetcher.reset (new prefetcher (prefetch));
+
+    if (status.empty ())
+      return;
+
+    // Files that were recorded as successfully processed by an
+    // earlier run are skipped this time around.
+    std::ifstream prev (status.c_str ());
+    for (std::string line; std::getline (prev, line); )
+      if (line.compare (0, 3, "ok\t") == 0)
+	m_done.insert (line.substr (3));
+
+    m_status.open (status.c_str (), std::ios::app);
+    if (! m_status)
+      throw std::runtime_error ("Couldn't open status file `"
+				+ status + "'");
+  }
+
+  // FNAME is to be processed after the files added before.
+  void
+  add (std::string const &fname)
+  {
+    if (m_prefetcher == NULL)
+      {
+	process_file (fname);
+	return;
+      }
+
+    if (m_done.find (fname) != m_done.end ())
+      return;
+
+    m_prefetcher->add (fname);
+    m_queue.push_back (fname);
+    if (m_queue.size () > lookahead)
+      process_next ();
+  }
+
+  void
+  process_next ()
+  {
+    std::string fname = m_queue.front ();
+    m_queue.pop_front ();
+    m_prefetcher->next ();
+    process_file (fname);
+  }
+
+  // Process the files that are still waiting.
+  void
+  finish ()
+  {
+    while (! m_queue.empty ())
+      process_next ();
+  }
+
+  void
+  process_file (std::string const &fname)
+  {
+    if (m_done.find (fname) != m_done.end ())
+      return;
+
+    if (m_verbose)
+      std::cout << std::endl << fname << ":" << std::endl;
+
+    try
+      {
+	// Standard input is read as a whole, so that we can look at
+	// it both as an archive, and as an ELF file.
+	std::vector <char> image;
+	std::unique_ptr <archive> ar;
+	if (fname == "-")
+	  {
+	    read_all (STDIN_FILENO, image);
+	    ar = archive::open (image);
+	  }
+	else
+	  ar = archive::open (fname.c_str ());
+
+	bool complete;
+	if (ar != NULL)
+	  complete = process_archive (fname, *ar, m_ignore, m_dump);
+	else
+	  {
+	    Dwarf *dw = fname == "-"
+	      ? m_dwfl.open_dwarf ("<stdin>", image)
+	      : m_dwfl.open_dwarf (fname.c_str ());
+
+	    // Each coverage worker needs a Dwarf handle of its own.
+	    dwarf_pool pool (dw);
+	    std::vector <Dwarf *> workers;
+	    for (unsigned i = 0; i < opt_jobs; ++i)
+	      workers.push_back (pool.get ());
+
+	    complete = process (dw, workers, m_ignore, m_dump);
+	  }
+
+	if (! complete)
+	{
+	  // Not recorded as ok, so that a resumed run does the file
+	  // again.
+	  record ("partial", fname);
+	  return;
+	}
+      }
+    catch (std::runtime_error const &e)
+      {
+	std::cerr << "error: " << fname << ": " << e.what ()
+		  << ". (skipping)" << std::endl;
+	record ("fail", fname, e.what ());
+	m_failed++;
+	return;
+      }
+
+    record ("ok", fname);
+  }
+
+  unsigned
+  failed () const
+  {
+    return m_failed;
+  }
+};
+
 int
 main (int argc, char *argv[])
 {
@@ -888,7 +2581,7 @@ main (int argc, char *argv[])
   argp_program_bug_address = "pmachata@gmail.com";
   argp_parse (&argp, argc, argv, 0, &remaining, NULL);
 
-  if (remaining == argc)
+  if (remaining == argc && opt_files_from.empty ())
     {
       fputs (gettext ("Missing file name.\n"), stderr);
       argp_help (&argp, stderr, ARGP_HELP_SEE | ARGP_HELP_EXIT_ERR,
@@ -899,18 +2592,95 @@ main (int argc, char *argv[])
   die_type_matcher ignore (opt_ignore);
   die_type_matcher dump (opt_dump);
 
-  bool only_one = remaining + 1 == argc;
-  do
+  if (opt_diff)
+    {
+      if (remaining + 2 != argc || ! opt_files_from.empty ())
+	{
+	  fputs (gettext ("--diff needs exactly two files.\n"), stderr);
+	  argp_help (&argp, stderr, ARGP_HELP_SEE | ARGP_HELP_EXIT_ERR,
+		     program_invocation_short_name);
+	  std::exit (1);
+	}
+      return diff (argv[remaining], argv[remaining + 1], ignore, dump);
+    }
+
+  if (opt_resume && opt_checkpoint.empty ())
+    {
+      fputs (gettext ("--resume needs --checkpoint.\n"), stderr);
+      std::exit (1);
+    }
+
+  // Only the tally and errors are saved, and a resumed run wouldn't
+  // have the rest.
+  if (! opt_checkpoint.empty ()
+      && (! opt_group_by.empty () || opt_pc_map || dump.any ()))
+    {
+      fputs (gettext ("--checkpoint can't be used with --group-by, "
+		      "--pc-map or --dump.\n"), stderr);
+      std::exit (1);
+    }
+
+  if (opt_merge)
+    return merge (argv + remaining, argc - remaining);
+
+  // Like with checkpoints, the workers only send back the tally and
+  // errors.
+  if (opt_procs > 0
+      && (opt_jobs > 0 || ! opt_checkpoint.empty ()
+	  || ! opt_group_by.empty () || opt_pc_map || dump.any ()))
     {
-      char const *fname = argv[remaining];
-      if (! only_one)
-	std::cout << std::endl << fname << ":" << std::endl;
+      fputs (gettext ("--procs can't be used with --jobs, --checkpoint, "
+		      "--group-by, --pc-map or --dump.\n"), stderr);
+      std::exit (1);
+    }
+
+  if (opt_files_from == "-"
+      && std::find (argv + remaining, argv + argc,
+		    std::string ("-")) != argv + argc)
+    {
+      fputs (gettext ("File `-' can't be read from standard input "
+		      "together with --files-from=-.\n"), stderr);
+      std::exit (1);
+    }
+
+  bool only_one = remaining + 1 == argc && opt_files_from.empty ();
+  if (! opt_save.empty () && ! only_one)
+    {
+      fputs (gettext ("--save needs exactly one file.\n"), stderr);
+      std::exit (1);
+    }
+  batch batch (ignore, dump, opt_status, ! only_one,
+	       only_one ? 0 : opt_prefetch << 20);
+
+  for (; remaining < argc; ++remaining)
+    batch.add (argv[remaining]);
+
+  if (! opt_files_from.empty ())
+    {
+      // Stream the file names, so that we don't need to hold the
+      // whole list in memory.
+      std::ifstream ifs;
+      std::istream *is = &std::cin;
+      if (opt_files_from != "-")
+	{
+	  ifs.open (opt_files_from.c_str ());
+	  if (! ifs)
+	    {
+	      std::cerr << "error: couldn't open `" << opt_files_from
+			<< "'." << std::endl;
+	      return 1;
+	    }
+	  is = &ifs;
+	}
 
-      dwfl dwfl;
-      Dwarf *dw = dwfl.open_dwarf (fname);
-      process (dw, ignore, dump);
+      for (std::string fname; std::getline (*is, fname); )
+	if (! fname.empty ())
+	  batch.add (fname);
     }
-  while (++remaining < argc);
+
+  batch.finish ();
+
+  return batch.failed () > 0 ? 1 : 0;
 }
 
 void
@@ -928,6 +2698,64 @@ parse_opt (int key, char *arg, struct argp_state *state)
       opt_show_progress = true;
       return 0;
 
+    case 'v':
+      opt_verbose = true;
+      return 0;
+
+    case 'j':
+      opt_jobs = std::strtoul (arg, NULL, 10);
+      return 0;
+
+    case OPT_DEADLINE:
+      opt_deadline = std::strtod (arg, NULL);
+      return 0;
+
+    case OPT_CHECKPOINT:
+      opt_checkpoint = arg;
+      return 0;
+
+    case OPT_RESUME:
+      opt_resume = true;
+      return 0;
+
+    case OPT_SHARD:
+      {
+	char *end;
+	opt_shard = std::strtoul (arg, &end, 10);
+	if (*end == '/')
+	  opt_shards = std::strtoul (end + 1, &end, 10);
+	if (*end != '\0' || opt_shard < 1 || opt_shard > opt_shards)
+	  argp_error (state, "Invalid shard `%s'.", arg);
+	return 0;
+      }
+
+    case OPT_SAVE:
+      opt_save = arg;
+      return 0;
+
+    case OPT_MERGE:
+      opt_merge = true;
+      return 0;
+
+    case OPT_PROCS:
+      opt_procs = std::strtoul (arg, NULL, 10);
+      return 0;
+
+    case OPT_PREFETCH:
+      opt_prefetch = std::strtoul (arg, NULL, 10);
+      return 0;
+
+    case OPT_FUNCTION:
+      opt_function = arg;
+      return 0;
+
+    case OPT_PC_RANGE:
+      opt_pc_range = arg;
+      opt_pc_ranges.clear ();
+      if (! parse_pc_ranges (arg, opt_pc_ranges))
+	argp_error (state, "Invalid address range `%s'.", arg);
+      return 0;
+
     case OPT_IGNORE:
       opt_ignore = arg;
       return 0;
@@ -936,6 +2764,10 @@ parse_opt (int key, char *arg, struct argp_state *state)
       opt_dump = arg;
       return 0;
 
+    case OPT_DUMP_FILE:
+      opt_dump_file = arg;
+      return 0;
+
     case OPT_TABULATE:
       opt_tabulate = arg;
       return 0;
@@ -943,6 +2775,41 @@ parse_opt (int key, char *arg, struct argp_state *state)
     case OPT_IGNORE_IMPLICIT_POINTER:
       opt_ignore_implicit_pointer = true;
       return 0;
+
+    case OPT_FILES_FROM:
+      opt_files_from = arg;
+      return 0;
+
+    case OPT_STATUS:
+      opt_status = arg;
+      return 0;
+
+    case OPT_GROUP_BY:
+      opt_group_by = arg;
+      // Check the keys now, rather than fail each file of a batch.
+      try
+	{
+	  groups_t groups (opt_group_by);
+	}
+      catch (std::runtime_error const &e)
+	{
+	  argp_error (state, "%s.", e.what ());
+	}
+      return 0;
+
+    case OPT_WORST:
+      opt_worst = std::strtoul (arg, NULL, 10);
+      return 0;
+
+    case OPT_DIFF:
+      opt_diff = true;
+      return 0;
+
+    case OPT_PC_MAP:
+      opt_pc_map = true;
+      if (arg != NULL)
+	opt_pc_map_functions = arg;
+      return 0;
     }
 
   return ARGP_ERR_UNKNOWN;
@@ -0,0 +1,140 @@
+/*
+   Copyright (C) 2015 Red Hat, Inc.
+   This file is part of dwlocstat.
+
+   This file is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   elfutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <gelf.h>
+
+#include "progress.hh"
+
+namespace
+{
+  // Redraw at most this often.
+  std::chrono::milliseconds const draw_interval (250);
+
+  uint64_t
+  debug_info_size (Dwarf *dw)
+  {
+    Elf *elf = dwarf_getelf (dw);
+    size_t shstrndx;
+    if (elf == NULL || elf_getshdrstrndx (elf, &shstrndx) != 0)
+      return 0;
+
+    for (Elf_Scn *scn = NULL; (scn = elf_nextscn (elf, scn)) != NULL; )
+      {
+	GElf_Shdr shdr_mem, *shdr = gelf_getshdr (scn, &shdr_mem);
+	if (shdr == NULL)
+	  continue;
+	char const *name = elf_strptr (elf, shstrndx, shdr->sh_name);
+	// libdw decompresses the section in place, so sh_size is the
+	// size of decompressed data, which is what DIE offsets use.
+	if (name != NULL && std::strcmp (name, ".debug_info") == 0)
+	  return shdr->sh_size;
+      }
+
+    return 0;
+  }
+
+  void
+  format_duration (char *buf, size_t size, double secs)
+  {
+    unsigned long s = secs;
+    std::snprintf (buf, size, "%lu:%02lu:%02lu",
+		   s / 3600, s / 60 % 60, s % 60);
+  }
+}
+
+progress_meter::progress_meter (Dwarf *dw, bool requested)
+  : m_enabled (requested && isatty (STDOUT_FILENO))
+  , m_total (m_enabled ? debug_info_size (dw) : 0)
+  , m_bytes (0)
+  , m_dies (0)
+  , m_start (clock::now ())
+  , m_next_draw (m_start)
+{
+}
+
+void
+progress_meter::finish ()
+{
+  if (m_enabled)
+    {
+      std::lock_guard <std::mutex> lock (m_draw_lock);
+      draw (true);
+      std::cout << std::endl;
+    }
+}
+
+void
+progress_meter::advance (uint64_t bytes, uint64_t dies)
+{
+  m_bytes += bytes;
+  m_dies += dies;
+
+  // Whoever comes first draws, others just go on.
+  std::unique_lock <std::mutex> lock (m_draw_lock, std::try_to_lock);
+  if (lock.owns_lock ())
+    draw (false);
+}
+
+void
+progress_meter::draw (bool final)
+{
+  clock::time_point now = clock::now ();
+  if (! final && now < m_next_draw)
+    return;
+  m_next_draw = now + draw_interval;
+
+  uint64_t bytes = m_bytes;
+  uint64_t dies = m_dies;
+  double elapsed
+    = std::chrono::duration_cast <std::chrono::duration <double> >
+	(now - m_start).count ();
+  if (elapsed <= 0)
+    elapsed = 1e-9;
+
+  double pct = m_total > 0 ? 100.0 * bytes / m_total : 0;
+  if (pct > 100)
+    pct = 100;
+  double bytes_per_sec = bytes / elapsed;
+
+  char eta[32];
+  if (final)
+    format_duration (eta, sizeof eta, elapsed);
+  else if (bytes_per_sec > 0 && m_total > bytes)
+    format_duration (eta, sizeof eta, (m_total - bytes) / bytes_per_sec);
+  else
+    std::strcpy (eta, "?:??:??");
+
+  char buf[128];
+  std::snprintf (buf, sizeof buf,
+		 "%5.1f%%  %8.2f MB/s  %10.0f DIEs/s  %s %s",
+		 pct, bytes_per_sec / (1024 * 1024), dies / elapsed,
+		 final ? "took" : "ETA", eta);
+  std::cout << buf << "\r" << std::flush;
+}
+
+void
+progress_meter::local::flush (Dwarf_Off off)
+{
+  uint64_t bytes = off > m_last ? off - m_last : 0;
+  m_last = off;
+  m_meter.advance (bytes, m_dies);
+  m_dies = 0;
+}
@@ -0,0 +1,113 @@
+/*
+   Copyright (C) 2015 Red Hat, Inc.
+   This file is part of dwlocstat.
+
+   This file is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   elfutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#ifndef DWLOCSTAT_PROGRESS_HH
+#define DWLOCSTAT_PROGRESS_HH
+
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <elfutils/libdw.h>
+
+// Progress meter based on position in .debug_info.  The meter is
+// shared by everyone that processes the file, each of which reports
+// through its own progress_meter::local.  Nothing is shown (and next
+// to nothing is done) unless standard output is a terminal.
+class progress_meter
+{
+  typedef std::chrono::steady_clock clock;
+
+  bool m_enabled;
+  uint64_t m_total;
+  std::atomic <uint64_t> m_bytes;
+  std::atomic <uint64_t> m_dies;
+  clock::time_point m_start;
+  clock::time_point m_next_draw;
+  std::mutex m_draw_lock;
+
+  void draw (bool final);
+
+public:
+  progress_meter (Dwarf *dw, bool requested);
+
+  // Draw the final state and move to the next line.
+  void finish ();
+
+  bool
+  enabled () const
+  {
+    return m_enabled;
+  }
+
+  uint64_t
+  total () const
+  {
+    return m_total;
+  }
+
+  void advance (uint64_t bytes, uint64_t dies);
+
+  // Per-thread accumulator.  It only touches the shared meter once
+  // in a while, so that neither the atomics nor the clock show up
+  // on the per-DIE path.  Call done at the end of processing,
+  // otherwise the last few DIEs go unaccounted.
+  class local
+  {
+    progress_meter &m_meter;
+    Dwarf_Off m_last;
+    unsigned m_dies;
+
+    void flush (Dwarf_Off off);
+
+  public:
+    explicit local (progress_meter &meter)
+      : m_meter (meter)
+      , m_last (0)
+      , m_dies (0)
+    {}
+
+    // Note that processing continues at OFF, which is not
+    // necessarily right after the last DIE seen.
+    void
+    start (Dwarf_Off off)
+    {
+      if (m_meter.enabled ())
+	{
+	  flush (m_last);
+	  m_last = off;
+	}
+    }
+
+    // Note that a DIE at OFF is being processed.
+    void
+    die (Dwarf_Off off)
+    {
+      if (m_meter.enabled () && ++m_dies >= 4096)
+	flush (off);
+    }
+
+    // Note that everything up to END was processed.
+    void
+    done (Dwarf_Off end)
+    {
+      if (m_meter.enabled ())
+	flush (end);
+    }
+  };
+};
+
+#endif /* DWLOCSTAT_PROGRESS_HH */
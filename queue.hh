@@ -0,0 +1,201 @@
+/*
+   Copyright (C) 2015 Red Hat, Inc.
+   This file is part of dwlocstat.
+
+   This file is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   elfutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#ifndef DWLOCSTAT_QUEUE_HH
+#define DWLOCSTAT_QUEUE_HH
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <cassert>
+
+// Bounded lock-free queue for any number of producers and consumers.
+// Each cell carries a sequence number that tells whether it is ready
+// to be written or read on the current lap, so that producers and
+// consumers only contend on their respective position counters.
+// T should be cheap to copy, such as a pointer to a batch of work.
+//
+// The blocking push and pop spin for a short while, then sleep on a
+// condition variable, so that idle threads don't burn a core each.
+// The lock is only taken when someone sleeps.
+template <class T>
+class bounded_queue
+{
+  struct cell
+  {
+    std::atomic <size_t> seq;
+    T data;
+  };
+
+  std::unique_ptr <cell[]> m_cells;
+  size_t m_mask;
+  alignas (64) std::atomic <size_t> m_enqueue_pos;
+  alignas (64) std::atomic <size_t> m_dequeue_pos;
+
+  // Number of threads sleeping, or about to, in push or pop.
+  alignas (64) std::atomic <unsigned> m_sleepers;
+  std::mutex m_mutex;
+  std::condition_variable m_cond;
+
+  // How many times to retry before going to sleep.
+  static unsigned const spins = 64;
+
+  // Wake up sleepers after a push or pop, which may have made room
+  // or brought data for them.  The fence orders the update of the
+  // cell before the check of M_SLEEPERS, pairing with the one in
+  // wait_until.
+  void
+  wake ()
+  {
+    std::atomic_thread_fence (std::memory_order_seq_cst);
+    if (m_sleepers.load (std::memory_order_relaxed) != 0)
+      {
+	std::lock_guard <std::mutex> lock (m_mutex);
+	m_cond.notify_all ();
+      }
+  }
+
+  // Call TRY_IT until it succeeds, spinning at first, then sleeping.
+  template <class F>
+  void
+  wait_until (F try_it)
+  {
+    for (unsigned i = 0; i < spins; ++i)
+      if (try_it ())
+	return;
+      else
+	std::this_thread::yield ();
+
+    std::unique_lock <std::mutex> lock (m_mutex);
+    m_sleepers.fetch_add (1);
+    std::atomic_thread_fence (std::memory_order_seq_cst);
+    while (! try_it ())
+      m_cond.wait (lock);
+    m_sleepers.fetch_sub (1);
+  }
+
+  bounded_queue (bounded_queue const &that); /* never implemented */
+
+  // Push and pop without blocking, and without waking anyone.
+  bool
+  put (T const &data)
+  {
+    size_t pos = m_enqueue_pos.load (std::memory_order_relaxed);
+    for (;;)
+      {
+	cell &c = m_cells[pos & m_mask];
+	size_t seq = c.seq.load (std::memory_order_acquire);
+	intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+	if (dif == 0)
+	  {
+	    if (m_enqueue_pos.compare_exchange_weak
+		  (pos, pos + 1, std::memory_order_relaxed))
+	      {
+		c.data = data;
+		c.seq.store (pos + 1, std::memory_order_release);
+		return true;
+	      }
+	  }
+	else if (dif < 0)
+	  // Full.
+	  return false;
+	else
+	  pos = m_enqueue_pos.load (std::memory_order_relaxed);
+      }
+  }
+
+  bool
+  take (T &data)
+  {
+    size_t pos = m_dequeue_pos.load (std::memory_order_relaxed);
+    for (;;)
+      {
+	cell &c = m_cells[pos & m_mask];
+	size_t seq = c.seq.load (std::memory_order_acquire);
+	intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+	if (dif == 0)
+	  {
+	    if (m_dequeue_pos.compare_exchange_weak
+		  (pos, pos + 1, std::memory_order_relaxed))
+	      {
+		data = c.data;
+		c.seq.store (pos + m_mask + 1, std::memory_order_release);
+		return true;
+	      }
+	  }
+	else if (dif < 0)
+	  // Empty.
+	  return false;
+	else
+	  pos = m_dequeue_pos.load (std::memory_order_relaxed);
+      }
+  }
+
+public:
+  // SIZE must be a power of two.
+  explicit bounded_queue (size_t size)
+    : m_cells (new cell[size])
+    , m_mask (size - 1)
+    , m_enqueue_pos (0)
+    , m_dequeue_pos (0)
+    , m_sleepers (0)
+  {
+    assert (size >= 2 && (size & (size - 1)) == 0);
+    for (size_t i = 0; i < size; ++i)
+      m_cells[i].seq.store (i, std::memory_order_relaxed);
+  }
+
+  bool
+  try_push (T const &data)
+  {
+    if (! put (data))
+      return false;
+    wake ();
+    return true;
+  }
+
+  bool
+  try_pop (T &data)
+  {
+    if (! take (data))
+      return false;
+    wake ();
+    return true;
+  }
+
+  void
+  push (T const &data)
+  {
+    if (! put (data))
+      wait_until ([this, &data] () { return put (data); });
+    wake ();
+  }
+
+  T
+  pop ()
+  {
+    T ret;
+    if (! take (ret))
+      wait_until ([this, &ret] () { return take (ret); });
+    wake ();
+    return ret;
+  }
+};
+
+#endif /* DWLOCSTAT_QUEUE_HH */
@@ -0,0 +1,143 @@
+/*
+   Copyright (C) 2015 Red Hat, Inc.
+   This file is part of dwlocstat.
+
+   This file is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   elfutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+// Unit tests of the interval arithmetic in coverage.hh.  Run by
+// "make check".
+
+#include <iostream>
+
+#include "coverage.hh"
+
+namespace
+{
+  int failures = 0;
+
+  ranges_t
+  make (std::initializer_list <range_t> list)
+  {
+    return ranges_t (list);
+  }
+
+  std::ostream &
+  operator<< (std::ostream &os, ranges_t const &ranges)
+  {
+    os << '{';
+    for (size_t i = 0; i < ranges.size (); ++i)
+      os << (i > 0 ? ", " : "") << '[' << ranges[i].first
+	 << ", " << ranges[i].second << ')';
+    return os << '}';
+  }
+
+  void
+  check_normalize (char const *what, ranges_t ranges,
+		   ranges_t const &expect)
+  {
+    normalize_ranges (ranges);
+    if (ranges != expect)
+      {
+	std::cerr << "normalize_ranges, " << what << ": got " << ranges
+		  << ", expected " << expect << std::endl;
+	++failures;
+      }
+  }
+
+  // Check intersection of A and B both ways, with and without OUT.
+  void
+  check_intersect (char const *what, ranges_t const &a, ranges_t const &b,
+		   ranges_t const &expect)
+  {
+    Dwarf_Addr length = 0;
+    for (size_t i = 0; i < expect.size (); ++i)
+      length += expect[i].second - expect[i].first;
+
+    for (int swap = 0; swap < 2; ++swap)
+      {
+	ranges_t const &x = swap ? b : a;
+	ranges_t const &y = swap ? a : b;
+	ranges_t out;
+	Dwarf_Addr got = intersect_ranges (x.data (), x.size (),
+					   y.data (), y.size (), &out);
+	Dwarf_Addr got_no_out = intersect_ranges (x.data (), x.size (),
+						  y.data (), y.size (), NULL);
+	if (got != length || got_no_out != length || out != expect)
+	  {
+	    std::cerr << "intersect_ranges, " << what
+		      << (swap ? " (swapped)" : "") << ": got " << out
+		      << " of length " << got << '/' << got_no_out
+		      << ", expected " << expect << " of length " << length
+		      << std::endl;
+	    ++failures;
+	  }
+      }
+  }
+}
+
+int
+main ()
+{
+  check_normalize ("empty", make ({}), make ({}));
+  check_normalize ("single", make ({{1, 5}}), make ({{1, 5}}));
+  check_normalize ("disjoint, unsorted",
+		   make ({{10, 20}, {1, 5}, {30, 31}}),
+		   make ({{1, 5}, {10, 20}, {30, 31}}));
+  check_normalize ("overlapping",
+		   make ({{1, 10}, {5, 15}, {12, 13}}),
+		   make ({{1, 15}}));
+  check_normalize ("adjacent", make ({{5, 10}, {1, 5}, {10, 12}}),
+		   make ({{1, 12}}));
+  check_normalize ("contained", make ({{1, 100}, {10, 20}, {50, 60}}),
+		   make ({{1, 100}}));
+  check_normalize ("duplicate", make ({{3, 4}, {3, 4}}), make ({{3, 4}}));
+
+  check_intersect ("both empty", make ({}), make ({}), make ({}));
+  check_intersect ("one empty", make ({{1, 10}}), make ({}), make ({}));
+  check_intersect ("disjoint", make ({{1, 5}, {20, 25}}),
+		   make ({{6, 19}, {30, 40}}), make ({}));
+  check_intersect ("adjacent", make ({{1, 5}}), make ({{5, 10}}),
+		   make ({}));
+  check_intersect ("overlapping", make ({{1, 10}}), make ({{5, 15}}),
+		   make ({{5, 10}}));
+  check_intersect ("contained", make ({{1, 100}}),
+		   make ({{10, 20}, {30, 40}}),
+		   make ({{10, 20}, {30, 40}}));
+  check_intersect ("identical", make ({{1, 5}, {7, 9}}),
+		   make ({{1, 5}, {7, 9}}), make ({{1, 5}, {7, 9}}));
+  check_intersect ("many to many", make ({{0, 10}, {20, 30}, {40, 50}}),
+		   make ({{5, 25}, {28, 45}}),
+		   make ({{5, 10}, {20, 25}, {28, 30}, {40, 45}}));
+  // Pieces of the intersection one address apart are kept apart.
+  check_intersect ("nearly touching pieces", make ({{0, 10}}),
+		   make ({{0, 5}, {6, 10}}), make ({{0, 5}, {6, 10}}));
+  check_intersect ("top of address space", make ({{0, ~(Dwarf_Addr) 0}}),
+		   make ({{~(Dwarf_Addr) 0 - 4, ~(Dwarf_Addr) 0}}),
+		   make ({{~(Dwarf_Addr) 0 - 4, ~(Dwarf_Addr) 0}}));
+
+  ranges_t out;
+  append_range (&out, 1, 2);
+  append_range (&out, 2, 4);
+  append_range (&out, 5, 6);
+  append_range (NULL, 7, 8);
+  if (out != make ({{1, 4}, {5, 6}}))
+    {
+      std::cerr << "append_range: got " << out << std::endl;
+      ++failures;
+    }
+
+  if (failures > 0)
+    std::cerr << failures << " check(s) failed." << std::endl;
+  return failures > 0 ? 1 : 0;
+}